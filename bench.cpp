@@ -0,0 +1,58 @@
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <new>
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// Out of line so GCC does not pair the inlined malloc/free with new/delete and warn about a mismatch.
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+int main(int argc, char** argv) {
+    allocations_counted = true;
+    try {
+        BenchOptions opts;
+        std::string out_path;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << std::endl;
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--out") {
+                out_path = value;
+            } else if (!parse_bench_option(arg, value, opts)) {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+
+        if (out_path.empty()) {
+            return run_benchmarks(opts, std::cout) ? 0 : 1;
+        }
+        std::ofstream out(out_path);
+        if (!out.is_open()) {
+            std::cerr << "Error opening " << out_path << std::endl;
+            return 1;
+        }
+        return run_benchmarks(opts, out) ? 0 : 1;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,1128 @@
+#pragma once
+
+#include "bpe.hpp"
+#include "import.hpp"
+#include "prune.hpp"
+#include "shards.hpp"
+#include "shm.hpp"
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Incremented by the operator new replacement in bench.cpp, which also sets allocations_counted.
+inline std::atomic<uint64_t> allocation_count{0};
+inline bool allocations_counted = false;
+
+struct BenchOptions {
+    std::string data_path = "data.txt";
+    int vocab_size = MAX_VOCAB_SIZE;
+    size_t input_bytes = 1 << 16;
+    int special_tokens = 256;
+    double min_seconds = 0.5;
+    uint32_t seed = 42;
+    int scaling_max_vocab = 262144;
+    size_t scaling_bytes = 16 << 20;
+    int threads = 4;
+};
+
+inline bool parse_bench_option(const std::string& arg, const std::string& value, BenchOptions& opts) {
+    if (arg == "--data") {
+        opts.data_path = value;
+    } else if (arg == "--vocab-size") {
+        opts.vocab_size = std::stoi(value);
+    } else if (arg == "--input-bytes") {
+        opts.input_bytes = std::stoul(value);
+    } else if (arg == "--special-tokens") {
+        opts.special_tokens = std::stoi(value);
+    } else if (arg == "--min-seconds") {
+        opts.min_seconds = std::stod(value);
+    } else if (arg == "--seed") {
+        opts.seed = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--scaling-max-vocab") {
+        opts.scaling_max_vocab = std::stoi(value);
+    } else if (arg == "--scaling-bytes") {
+        opts.scaling_bytes = std::stoul(value);
+    } else if (arg == "--threads") {
+        opts.threads = std::stoi(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+class JsonObject {
+public:
+    JsonObject& str(const std::string& key, const std::string& value) {
+        fields.emplace_back(key, quote(value));
+        return *this;
+    }
+
+    JsonObject& num(const std::string& key, double value) {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.6g", value);
+        fields.emplace_back(key, buf);
+        return *this;
+    }
+
+    JsonObject& integer(const std::string& key, int64_t value) {
+        fields.emplace_back(key, std::to_string(value));
+        return *this;
+    }
+
+    JsonObject& flag(const std::string& key, bool value) {
+        fields.emplace_back(key, value ? "true" : "false");
+        return *this;
+    }
+
+    // A flag that must be true; run_benchmarks fails the run if it is not.
+    JsonObject& check(const std::string& key, bool value) {
+        if (!value) failed.push_back(key);
+        return flag(key, value);
+    }
+
+    const std::vector<std::string>& failed_checks() const {
+        return failed;
+    }
+
+    JsonObject& raw(const std::string& key, const std::string& json) {
+        fields.emplace_back(key, json);
+        return *this;
+    }
+
+    std::string dump() const {
+        std::string out = "{";
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (i > 0) out += ", ";
+            out += quote(fields[i].first) + ": " + fields[i].second;
+        }
+        return out + "}";
+    }
+
+    static std::string quote(const std::string& s) {
+        std::string out = "\"";
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            } else if (c < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+        return out + "\"";
+    }
+
+private:
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::vector<std::string> failed;
+};
+
+inline JsonObject instrumentation_json(const InstrumentStats& stats) {
+    JsonObject counters, phases;
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        counters.integer(counter_name(i), stats.counters[i]);
+    }
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        phases.integer(phase_name(i), stats.phase_ns[i]);
+    }
+    std::string merges = "[";
+    for (size_t i = 0; i < stats.merges.size(); ++i) {
+        const MergeTiming& merge = stats.merges[i];
+        if (i > 0) merges += ", ";
+        merges += JsonObject().integer("id", merge.id).integer("count", merge.count).integer("ns", merge.ns).dump();
+    }
+    merges += "]";
+    return JsonObject()
+        .flag("enabled", Instrumentation::enabled())
+        .raw("counters", counters.dump())
+        .raw("phase_ns", phases.dump())
+        .raw("merges", merges);
+}
+
+inline void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs.is_open()) {
+        clear_refs << "5";
+    }
+}
+
+inline long peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::stol(line.substr(6));
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+template <class F>
+std::pair<double, int> time_repeated(double min_seconds, F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    int iterations = 0;
+    double elapsed = 0.0;
+    do {
+        f();
+        iterations++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    return {elapsed, iterations};
+}
+
+inline std::string bench_english(size_t n, std::mt19937& rng) {
+    static const char* words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+        "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+        "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+        "more", "when", "will", "would", "who", "so", "no", "theory", "relativity", "physics", "light",
+        "energy", "university", "published", "paper", "quantum", "mass", "field", "gravitation", "Einstein",
+    };
+    const size_t num_words = sizeof(words) / sizeof(words[0]);
+    std::string out;
+    bool capitalize = true;
+    while (out.size() < n) {
+        std::string word = words[rng() % num_words];
+        if (capitalize) word[0] = static_cast<char>(std::toupper(static_cast<unsigned char>(word[0])));
+        out += word;
+        capitalize = false;
+        unsigned roll = rng() % 16;
+        if (roll == 0) {
+            out += ". ";
+            capitalize = true;
+        } else if (roll == 1) {
+            out += ", ";
+        } else {
+            out += ' ';
+        }
+    }
+    out.resize(n);
+    return out;
+}
+
+inline std::string bench_code(size_t n, std::mt19937& rng) {
+    static const char* types[] = {"int", "size_t", "double", "auto", "std::string", "bool"};
+    static const char* ops[] = {" + ", " - ", " * ", " / ", " % ", " << ", " & "};
+    std::string out;
+    int fn = 0;
+    while (out.size() < n) {
+        std::string name = "compute_" + std::to_string(fn++);
+        out += std::string(types[rng() % 6]) + " " + name + "(int a, int b) {\n";
+        int statements = 1 + rng() % 5;
+        for (int i = 0; i < statements; ++i) {
+            out += "    int v" + std::to_string(i) + " = a" + ops[rng() % 7] + std::to_string(rng() % 1000) + ";\n";
+            out += "    if (v" + std::to_string(i) + " > b) {\n        b += v" + std::to_string(i) + ";\n    }\n";
+        }
+        out += "    return a" + std::string(ops[rng() % 7]) + "b;\n}\n\n";
+    }
+    out.resize(n);
+    return out;
+}
+
+inline std::string bench_cjk(size_t n, std::mt19937& rng) {
+    std::string out;
+    while (out.size() + 3 <= n) {
+        unsigned roll = rng() % 20;
+        unsigned cp = roll == 0 ? 0x3002 : roll == 1 ? 0xFF0C : 0x4E00 + rng() % (0x9FFF - 0x4E00);
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+inline std::string bench_random_bytes(size_t n, std::mt19937& rng) {
+    std::string out(n, '\0');
+    for (char& c : out) {
+        c = static_cast<char>(rng() & 0xFF);
+    }
+    return out;
+}
+
+inline std::string bench_no_whitespace(size_t n, std::mt19937& rng) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out(n, '\0');
+    for (char& c : out) {
+        c = alphabet[rng() % 64];
+    }
+    return out;
+}
+
+inline std::string bench_zipf_words(size_t n, size_t lexicon_size, std::mt19937& rng) {
+    static const char consonants[] = "bcdfghjklmnprstvwz";
+    static const char vowels[] = "aeiou";
+    std::vector<std::string> lexicon(lexicon_size);
+    std::vector<double> cumulative(lexicon_size);
+    double total = 0.0;
+    for (size_t r = 0; r < lexicon_size; ++r) {
+        int syllables = 1 + rng() % 4;
+        for (int i = 0; i < syllables; ++i) {
+            lexicon[r] += consonants[rng() % 18];
+            lexicon[r] += vowels[rng() % 5];
+            if (rng() % 3 == 0) lexicon[r] += consonants[rng() % 18];
+        }
+        total += 1.0 / (r + 1);
+        cumulative[r] = total;
+    }
+
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    std::string out;
+    while (out.size() < n) {
+        size_t r = std::lower_bound(cumulative.begin(), cumulative.end(), uniform(rng)) - cumulative.begin();
+        out += lexicon[std::min(r, lexicon_size - 1)];
+        out += rng() % 12 == 0 ? ". " : " ";
+    }
+    out.resize(n);
+    return out;
+}
+
+inline std::string bench_load_corpus(const BenchOptions& opts, std::mt19937& rng) {
+    std::ifstream file(opts.data_path, std::ios::binary);
+    if (file.is_open()) {
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        if (!buffer.str().empty()) {
+            return buffer.str();
+        }
+    }
+    return bench_english(160000, rng);
+}
+
+inline std::string repeat_to_size(const std::string& text, size_t n) {
+    std::string out;
+    while (out.size() < n) {
+        out += text;
+    }
+    out.resize(n);
+    return out;
+}
+
+inline JsonObject bench_encode(const BPETokenizer& tokenizer, const std::string& name, const std::string& input,
+                               double min_seconds) {
+    std::vector<int> encoded;
+    auto [seconds, iterations] = time_repeated(min_seconds, [&] { encoded = tokenizer.encode(input); });
+    double bytes = static_cast<double>(input.size()) * iterations;
+    double tokens = static_cast<double>(encoded.size()) * iterations;
+    return JsonObject()
+        .str("name", "encode/" + name)
+        .num("bytes", input.size())
+        .num("tokens", encoded.size())
+        .num("iterations", iterations)
+        .num("seconds", seconds)
+        .num("mb_per_sec", bytes / 1e6 / seconds)
+        .num("tokens_per_sec", tokens / seconds)
+        .check("roundtrip", tokenizer.decode(encoded) == input);
+}
+
+inline JsonObject bench_decode(const BPETokenizer& tokenizer, const std::string& name, const std::string& input,
+                               double min_seconds) {
+    std::vector<int> encoded = tokenizer.encode(input);
+    std::string decoded;
+    auto [seconds, iterations] = time_repeated(min_seconds, [&] { decoded = tokenizer.decode(encoded); });
+    double bytes = static_cast<double>(decoded.size()) * iterations;
+    double tokens = static_cast<double>(encoded.size()) * iterations;
+    return JsonObject()
+        .str("name", "decode/" + name)
+        .num("bytes", decoded.size())
+        .num("tokens", encoded.size())
+        .num("iterations", iterations)
+        .num("seconds", seconds)
+        .num("mb_per_sec", bytes / 1e6 / seconds)
+        .num("tokens_per_sec", tokens / seconds);
+}
+
+// A tiktoken vocabulary of runs of 2 to 65 copies of 40 characters: 2816 tokens, small enough for the dense
+// table, but with one merge per split of each run, 83200 merges in all. Dense and hash lookups must agree on it.
+inline JsonObject bench_many_merges_lookup(std::mt19937& rng) {
+    const int CHARS = 40;
+    const int MAX_RUN = 65;
+    static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    auto base64 = [](const std::string& bytes) {
+        std::string out;
+        for (size_t i = 0; i < bytes.size(); i += 3) {
+            uint32_t n = static_cast<unsigned char>(bytes[i]) << 16;
+            if (i + 1 < bytes.size()) n |= static_cast<unsigned char>(bytes[i + 1]) << 8;
+            if (i + 2 < bytes.size()) n |= static_cast<unsigned char>(bytes[i + 2]);
+            for (size_t k = 0; k < 4; ++k) {
+                out += i + k <= bytes.size() ? BASE64[(n >> (18 - 6 * k)) & 63] : '=';
+            }
+        }
+        return out;
+    };
+    std::string file;
+    int rank = 0;
+    for (int b = 0; b < 256; ++b) {
+        file += base64(std::string(1, static_cast<char>(b))) + " " + std::to_string(rank++) + "\n";
+    }
+    for (int c = 0; c < CHARS; ++c) {
+        for (int run = 2; run <= MAX_RUN; ++run) {
+            file += base64(std::string(run, static_cast<char>('A' + c))) + " " + std::to_string(rank++) + "\n";
+        }
+    }
+    std::string path = "/tmp/bpe-bench-" + std::to_string(::getpid()) + ".tiktoken";
+    std::ofstream(path, std::ios::binary) << file;
+    BPETokenizer hash = load_tiktoken(path, PreTokenizer::none);
+    std::remove(path.c_str());
+    BPETokenizer dense = hash;
+    hash.set_merge_lookup(MergeLookup::hash);
+    dense.set_merge_lookup(MergeLookup::dense);
+
+    std::string input;
+    while (input.size() < (1 << 16)) {
+        input.append(1 + rng() % (2 * MAX_RUN), static_cast<char>('A' + rng() % CHARS));
+        input += ' ';
+    }
+    std::vector<int> hash_ids = hash.encode(input), dense_ids = dense.encode(input);
+    return JsonObject()
+        .str("name", "encode/many_merges_lookup")
+        .num("vocab_size", hash.vocab_size())
+        .num("merges", hash.num_merges())
+        .check("dense_selected", dense.merge_lookup() == MergeLookup::dense)
+        .check("identical", dense_ids == hash_ids)
+        .check("roundtrip", dense.decode(dense_ids) == input);
+}
+
+// All threads encode the same input with one shared FrozenTokenizer and must agree with a serial encode.
+inline JsonObject bench_shared_encode(const FrozenTokenizer& tokenizer, const std::string& name,
+                                      const std::string& input, int num_threads, double min_seconds) {
+    std::vector<int> expected = tokenizer.encode(input);
+    std::vector<int> iterations(num_threads, 0);
+    std::vector<char> consistent(num_threads, 1);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<int> ids;
+            time_repeated(min_seconds, [&] {
+                ids.clear();
+                tokenizer.encode(input, ids);
+                consistent[t] &= ids == expected;
+                iterations[t]++;
+            });
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double total = 0;
+    for (int n : iterations) {
+        total += n;
+    }
+    return JsonObject()
+        .str("name", "encode/" + name)
+        .num("bytes", input.size())
+        .num("threads", num_threads)
+        .num("iterations", total)
+        .num("seconds", seconds)
+        .num("mb_per_sec", input.size() * total / 1e6 / seconds)
+        .check("consistent", std::find(consistent.begin(), consistent.end(), 0) == consistent.end());
+}
+
+// Encodes with a warmed-up scratch and output buffer; a steady-state encode must not allocate.
+inline JsonObject bench_steady_state_allocations(const FrozenTokenizer& tokenizer, const std::string& input) {
+    const int ITERATIONS = 16;
+    EncodeScratch scratch;
+    std::vector<int> ids;
+    tokenizer.encode(input, ids, scratch);
+    uint64_t before = allocation_count.load();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        ids.clear();
+        tokenizer.encode(input, ids, scratch);
+    }
+    uint64_t allocations = allocation_count.load() - before;
+    JsonObject result;
+    result.str("name", "encode/steady_state_allocations")
+        .num("bytes", input.size())
+        .num("iterations", ITERATIONS)
+        .flag("counted", allocations_counted);
+    // Only the bench binary replaces operator new; without it there is no count to check.
+    if (allocations_counted) {
+        result.num("allocations", allocations).check("allocation_free", allocations == 0);
+    }
+    return result;
+}
+
+// Counts the adjacent byte pairs of input into per-pair slots through PairIndex with its dense table, through
+// PairIndex's hash table alone, and through std::unordered_map, the pair table training used before.
+inline JsonObject bench_pair_counting(const std::string& input, double min_seconds) {
+    std::vector<int64_t> dense_counts, hash_counts, map_counts;
+    auto count_pairs = [&](auto& index, std::vector<int64_t>& counts) {
+        counts.clear();
+        for (size_t i = 1; i < input.size(); ++i) {
+            uint64_t key = pair_key(static_cast<unsigned char>(input[i - 1]), static_cast<unsigned char>(input[i]));
+            auto [slot, inserted] = index.try_emplace(key, static_cast<int>(counts.size()));
+            if (inserted) counts.push_back(0);
+            counts[slot]++;
+        }
+    };
+    auto [dense_seconds, dense_iterations] = time_repeated(min_seconds, [&] {
+        PairIndex index(true);
+        count_pairs(index, dense_counts);
+    });
+    auto [hash_seconds, hash_iterations] = time_repeated(min_seconds, [&] {
+        PairIndex index(false);
+        count_pairs(index, hash_counts);
+    });
+    auto [map_seconds, map_iterations] = time_repeated(min_seconds, [&] {
+        std::unordered_map<uint64_t, int> index;
+        std::vector<int64_t> counts;
+        for (size_t i = 1; i < input.size(); ++i) {
+            uint64_t key = pair_key(static_cast<unsigned char>(input[i - 1]), static_cast<unsigned char>(input[i]));
+            auto [it, inserted] = index.try_emplace(key, static_cast<int>(counts.size()));
+            if (inserted) counts.push_back(0);
+            counts[it->second]++;
+        }
+        map_counts = std::move(counts);
+    });
+    double bytes = static_cast<double>(input.size());
+    double dense_rate = bytes * dense_iterations / 1e6 / dense_seconds;
+    double hash_rate = bytes * hash_iterations / 1e6 / hash_seconds;
+    return JsonObject()
+        .str("name", "train/pair_counting")
+        .num("bytes", input.size())
+        .num("pairs", dense_counts.size())
+        .num("dense_mb_per_sec", dense_rate)
+        .num("hash_mb_per_sec", hash_rate)
+        .num("unordered_map_mb_per_sec", bytes * map_iterations / 1e6 / map_seconds)
+        .num("dense_speedup", dense_rate / hash_rate)
+        .check("identical_counts", dense_counts == hash_counts && hash_counts == map_counts);
+}
+
+// Times each special-token policy on the same input; `allowed` lets through one of the registered tokens.
+inline JsonObject bench_special_policies(const FrozenTokenizer& tokenizer, const std::string& input,
+                                         const std::string& allowed, double min_seconds) {
+    EncodeScratch scratch;
+    std::vector<int> ids;
+    JsonObject result;
+    result.str("name", "encode/special_tokens/policies").num("bytes", input.size());
+    for (SpecialMode mode : {SpecialMode::all, SpecialMode::none, SpecialMode::allowed}) {
+        SpecialPolicy policy = tokenizer.special_policy(mode, {allowed});
+        auto [seconds, iterations] = time_repeated(min_seconds, [&] {
+            ids.clear();
+            tokenizer.encode(input, ids, scratch, policy);
+        });
+        std::string name = mode == SpecialMode::all ? "all" : mode == SpecialMode::none ? "none" : "allowed";
+        result.num(name + "_mb_per_sec", input.size() * iterations / 1e6 / seconds).num(name + "_tokens", ids.size());
+    }
+    return result;
+}
+
+// Times BPE-dropout against deterministic encoding of the same input with the same scratch.
+// Expects a pre-tokenized model, so that both sides run the heap encoder (pieces stay below RANK_BUCKET_MIN_PIECE)
+// and the difference is dropout alone.
+inline JsonObject bench_dropout_encode(const BPETokenizer& model, const std::string& input, double probability,
+                                       uint64_t seed, double min_seconds) {
+    FrozenTokenizer tokenizer(model);
+    EncodeScratch scratch;
+    MergeDropout dropout(probability, seed);
+    std::vector<int> ids, dropped;
+    auto [base_seconds, base_iterations] = time_repeated(min_seconds, [&] {
+        ids.clear();
+        tokenizer.encode(input, ids, scratch);
+    });
+    auto [seconds, iterations] = time_repeated(min_seconds, [&] {
+        dropped.clear();
+        tokenizer.encode(input, dropped, scratch, dropout);
+    });
+    double base_rate = input.size() * base_iterations / base_seconds;
+    double rate = input.size() * iterations / seconds;
+    return JsonObject()
+        .str("name", "encode/english/dropout")
+        .str("pre_tokenizer", pre_tokenizer_name(model.pre_tokenizer_mode()))
+        .num("dropout", probability)
+        .num("bytes", input.size())
+        .num("tokens", dropped.size())
+        .num("deterministic_tokens", ids.size())
+        .num("iterations", iterations)
+        .num("seconds", seconds)
+        .num("mb_per_sec", rate / 1e6)
+        .num("deterministic_mb_per_sec", base_rate / 1e6)
+        .num("overhead", base_rate / rate - 1.0)
+        .check("roundtrip", tokenizer.decode(dropped) == input)
+        .check("changes_tokens", dropped.size() != ids.size());
+}
+
+// Greedy longest-match encoding against BPE on the same input: speed and how many more (or fewer) tokens it emits.
+inline JsonObject bench_greedy_encode(const BPETokenizer& tokenizer, const std::string& name, const std::string& input,
+                                      double min_seconds) {
+    FrozenTokenizer bpe(tokenizer);
+    FrozenTokenizer greedy(tokenizer, EncodeMode::greedy);
+    std::vector<int> bpe_ids, ids;
+    auto [bpe_seconds, bpe_iterations] = time_repeated(min_seconds, [&] {
+        bpe_ids.clear();
+        bpe.encode(input, bpe_ids);
+    });
+    auto [seconds, iterations] = time_repeated(min_seconds, [&] {
+        ids.clear();
+        greedy.encode(input, ids);
+    });
+    double bpe_rate = input.size() * bpe_iterations / bpe_seconds;
+    double rate = input.size() * iterations / seconds;
+    return JsonObject()
+        .str("name", "encode/" + name + "/greedy")
+        .num("bytes", input.size())
+        .num("iterations", iterations)
+        .num("seconds", seconds)
+        .num("mb_per_sec", rate / 1e6)
+        .num("bpe_mb_per_sec", bpe_rate / 1e6)
+        .num("speedup", rate / bpe_rate)
+        .num("tokens", ids.size())
+        .num("bpe_tokens", bpe_ids.size())
+        .num("token_difference", static_cast<double>(ids.size()) - static_cast<double>(bpe_ids.size()))
+        .num("token_ratio", static_cast<double>(ids.size()) / bpe_ids.size())
+        .check("roundtrip", greedy.decode(ids) == input);
+}
+
+// Encodes one long document serially and with encode_parallel; the two must produce the same ids.
+inline JsonObject bench_parallel_document(const FrozenTokenizer& tokenizer, const std::string& input, int num_threads,
+                                          double min_seconds) {
+    std::vector<int> serial, parallel;
+    auto [serial_seconds, serial_iterations] = time_repeated(min_seconds, [&] {
+        serial.clear();
+        tokenizer.encode(input, serial);
+    });
+    auto [seconds, iterations] = time_repeated(min_seconds, [&] {
+        parallel.clear();
+        tokenizer.encode_parallel(input, parallel, num_threads);
+    });
+    double serial_rate = input.size() * serial_iterations / serial_seconds;
+    double rate = input.size() * iterations / seconds;
+    return JsonObject()
+        .str("name", "encode/special_tokens/parallel_document")
+        .num("bytes", input.size())
+        .num("threads", num_threads)
+        .num("iterations", iterations)
+        .num("seconds", seconds)
+        .num("mb_per_sec", rate / 1e6)
+        .num("serial_mb_per_sec", serial_rate / 1e6)
+        .num("speedup", rate / serial_rate)
+        .check("identical", parallel == serial);
+}
+
+// Cuts input the way `bpe encode` cuts a stream read `read_size` bytes at a time and encodes the blocks one by one;
+// the ids must be those of one encode. A model without a pre-tokenizer or special tokens gets a single block.
+inline JsonObject bench_stream_blocks(const FrozenTokenizer& tokenizer, const std::string& name,
+                                      const std::string& input, size_t read_size) {
+    std::vector<int> whole, streamed, ids;
+    tokenizer.encode(input, whole);
+    std::string carry;
+    int blocks = 0;
+    auto encode_block = [&] {
+        ids.clear();
+        tokenizer.encode(carry, ids);
+        streamed.insert(streamed.end(), ids.begin(), ids.end());
+        blocks++;
+    };
+    for (size_t pos = 0; pos < input.size(); pos += read_size) {
+        size_t n = std::min(read_size, input.size() - pos);
+        carry.append(input, pos, n);
+        size_t cut = tokenizer.next_split(carry, carry.size() - n, SpecialPolicy(), true);
+        if (cut == carry.size()) continue;
+        std::string rest = carry.substr(cut);
+        carry.resize(cut);
+        encode_block();
+        carry = std::move(rest);
+    }
+    if (!carry.empty()) encode_block();
+    return JsonObject()
+        .str("name", "encode/stream/" + name)
+        .num("bytes", input.size())
+        .num("read_size", read_size)
+        .num("blocks", blocks)
+        .check("identical", streamed == whole);
+}
+
+// Runs `body` in a child process, which exits with its return value (1 if it throws).
+template <class Body>
+pid_t bench_fork(Body body) {
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+    }
+    if (pid == 0) {
+        int code = 1;
+        try {
+            code = body();
+        } catch (const std::exception&) {
+        }
+        ::_exit(code);
+    }
+    return pid;
+}
+
+// Waits up to `timeout` seconds for a child to exit 0, killing it if it does not finish in time.
+inline bool bench_wait_child(pid_t pid, double timeout, double& seconds) {
+    auto start = std::chrono::steady_clock::now();
+    int status = 0;
+    bool finished = true;
+    while (::waitpid(pid, &status, WNOHANG) == 0) {
+        if (std::chrono::steady_clock::now() - start > std::chrono::duration<double>(timeout)) {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, &status, 0);
+            finished = false;
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return finished && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Kills two clients mid-request and checks that a third still gets every request answered: one dies holding a
+// slot it never sent, the other after sending a request but before taking the result. Each process is forked
+// before the server threads start, and the dead ones are reaped so that their pids are gone.
+inline JsonObject bench_shm_dead_producers(const FrozenTokenizer& tokenizer, const std::string& input) {
+    const int REQUESTS = 64;
+    const double TIMEOUT_SECONDS = 10;
+    ShmOptions shm_opts;
+    shm_opts.name = "/bpe-bench-" + std::to_string(::getpid());
+    shm_opts.num_threads = 1;
+    shm_opts.num_slots = 2;
+    shm_opts.slot_bytes = 1 << 16;
+    ShmTokenizerServer server(tokenizer, shm_opts);
+    std::string text = input.substr(0, 4096);
+    std::vector<int> expected;
+    tokenizer.encode(text, expected);
+
+    auto killed = [](pid_t pid) {
+        int status = 0;
+        return ::waitpid(pid, &status, 0) == pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+    };
+    bool died = killed(bench_fork([&] {
+        ShmTokenizerClient(shm_opts.name).claim();
+        ::raise(SIGKILL);
+        return 0;
+    }));
+    died = killed(bench_fork([&] {
+        ShmTokenizerClient(shm_opts.name).submit(OP_ENCODE, text);
+        ::raise(SIGKILL);
+        return 0;
+    })) && died;
+
+    int go[2];
+    if (::pipe(go) != 0) {
+        throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+    }
+    pid_t checker = bench_fork([&] {
+        char byte;
+        if (::read(go[0], &byte, 1) != 1) return 1;
+        ShmTokenizerClient client(shm_opts.name);
+        for (int i = 0; i < REQUESTS; ++i) {
+            std::vector<int> ids;
+            client.encode(text, ids);
+            if (ids != expected) return 1;
+        }
+        return 0;
+    });
+    ::close(go[0]);
+    server.start();
+    bool started = ::write(go[1], "x", 1) == 1;
+    ::close(go[1]);
+    double seconds = 0;
+    bool answered = bench_wait_child(checker, TIMEOUT_SECONDS, seconds);
+    server.stop();
+    return JsonObject()
+        .str("name", "serve/shm_dead_producers")
+        .num("slots", shm_opts.num_slots)
+        .num("requests", REQUESTS)
+        .num("seconds", seconds)
+        .check("recovered", died && started && answered);
+}
+
+// A second server must not take over a running server's ring, but may replace one whose server was killed.
+inline JsonObject bench_shm_exclusive() {
+    std::string name = "/bpe-bench-" + std::to_string(::getpid()) + "-exclusive";
+    bool refused = false, kept = false, replaced = false;
+    {
+        ShmSegment running = ShmSegment::create(name, 1, 64);
+        try {
+            ShmSegment::create(name, 1, 64);
+        } catch (const std::runtime_error&) {
+            refused = true;
+        }
+        kept = ShmSegment::attach(name).header().server_pid == ::getpid();
+    }
+    pid_t killed = bench_fork([&] {
+        ShmSegment segment = ShmSegment::create(name, 1, 64);
+        ::raise(SIGKILL);
+        return 0;
+    });
+    int status = 0;
+    if (::waitpid(killed, &status, 0) == killed && WIFSIGNALED(status)) {
+        try {
+            replaced = ShmSegment::create(name, 1, 64).header().server_pid == ::getpid();
+        } catch (const std::runtime_error&) {
+        }
+    }
+    ::shm_unlink(name.c_str());
+    return JsonObject()
+        .str("name", "serve/shm_exclusive")
+        .check("refused", refused)
+        .check("kept", kept)
+        .check("replaced_stale", replaced);
+}
+
+// More producer threads than slots, so slots are claimed while their previous producer is still releasing them.
+// Runs in a child process so that a wedged ring shows up as a timeout.
+inline JsonObject bench_shm_contention(const FrozenTokenizer& tokenizer, const std::string& input) {
+    const int PRODUCERS = 8;
+    const int REQUESTS = 2000;
+    const double TIMEOUT_SECONDS = 60;
+    ShmOptions shm_opts;
+    shm_opts.name = "/bpe-bench-" + std::to_string(::getpid());
+    shm_opts.num_threads = 2;
+    shm_opts.num_slots = 4;
+    shm_opts.slot_bytes = 1 << 16;
+    std::vector<std::string> texts;
+    std::vector<std::vector<int>> expected(16);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        texts.push_back(input.substr(i * 97 % input.size(), 64 + i * 61));
+        tokenizer.encode(texts[i], expected[i]);
+    }
+
+    pid_t child = bench_fork([&] {
+        ShmTokenizerServer server(tokenizer, shm_opts);
+        server.start();
+        std::atomic<int> failures{0};
+        std::vector<std::thread> producers;
+        for (int p = 0; p < PRODUCERS; ++p) {
+            producers.emplace_back([&, p] {
+                try {
+                    ShmTokenizerClient client(shm_opts.name);
+                    std::vector<int> ids;
+                    for (int i = 0; i < REQUESTS; ++i) {
+                        size_t text = (p + i) % texts.size();
+                        ids.clear();
+                        client.encode(texts[text], ids);
+                        if (ids != expected[text]) failures++;
+                    }
+                } catch (const std::exception&) {
+                    failures++;
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        server.stop();
+        return failures.load() == 0 ? 0 : 1;
+    });
+    double seconds = 0;
+    bool answered = bench_wait_child(child, TIMEOUT_SECONDS, seconds);
+    return JsonObject()
+        .str("name", "serve/shm_contention")
+        .num("producers", PRODUCERS)
+        .num("slots", shm_opts.num_slots)
+        .num("requests", PRODUCERS * REQUESTS)
+        .num("seconds", seconds)
+        .num("requests_per_sec", PRODUCERS * REQUESTS / seconds)
+        .check("answered", answered);
+}
+
+// Token usage for pruning counted on one thread and on num_threads: the counts, and so the pruned vocabulary, must
+// not depend on the thread count.
+inline JsonObject bench_prune_usage(const BPETokenizer& model, const std::string& sample, int num_threads,
+                                    double min_seconds) {
+    FrozenTokenizer tokenizer(model);
+    std::vector<int64_t> serial = count_token_usage(tokenizer, sample, 1);
+    std::vector<int64_t> usage;
+    auto [seconds, iterations] = time_repeated(min_seconds, [&] {
+        usage = count_token_usage(tokenizer, sample, num_threads);
+    });
+    return JsonObject()
+        .str("name", "prune/usage/" + pre_tokenizer_name(model.pre_tokenizer_mode()))
+        .num("bytes", sample.size())
+        .num("threads", num_threads)
+        .num("iterations", iterations)
+        .num("seconds", seconds)
+        .num("mb_per_sec", sample.size() * iterations / seconds / 1e6)
+        .check("identical", usage == serial &&
+                               prune_vocabulary(model, usage, 2).id_map == prune_vocabulary(model, serial, 2).id_map);
+}
+
+// Prunes a model with a reserved special id and continues training it: the pruned model must start its special space
+// at the new id of the old start and keep the reserved id in place, as the original would.
+inline JsonObject bench_prune_special_space(const BPETokenizer& model, const std::string& sample) {
+    BPETokenizer reserved = model;
+    reserved.add_special_token("<|fixed|>", reserved.reserve_special_ids(2) + 1);
+    reserved.register_special_token("<|endoftext|>");
+    std::vector<int64_t> usage = count_token_usage(FrozenTokenizer(reserved), sample.substr(0, sample.size() / 16), 1);
+    PrunedVocab pruned = prune_vocabulary(reserved, usage, 2);
+    int fixed = pruned.id_map[reserved.special_token_id("<|fixed|>")];
+    bool same_start = pruned.tokenizer.special_space_start() == pruned.id_map[reserved.special_space_start()];
+    int removed = reserved.vocab_size() - pruned.tokenizer.vocab_size();
+    pruned.tokenizer.set_max_vocab(pruned.tokenizer.vocab_size() + 16);
+    pruned.tokenizer.train(sample);
+    return JsonObject()
+        .str("name", "prune/special_space")
+        .num("removed", removed)
+        .check("kept", same_start && pruned.tokenizer.special_token_id("<|fixed|>") == fixed);
+}
+
+// Writes `text` to a scratch file, runs `body` on its path in a child process and checks that it fails with a JSON
+// parse error within the timeout: a parser that stops consuming input shows up as a hang, not an error.
+template <class Body>
+bool bench_rejects_json(const std::string& text, Body body) {
+    const double TIMEOUT_SECONDS = 10;
+    std::string path = "/tmp/bpe-bench-" + std::to_string(::getpid()) + ".json";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << text;
+    }
+    pid_t pid = bench_fork([&] {
+        try {
+            body(path);
+        } catch (const std::runtime_error& e) {
+            return std::string(e.what()).find("JSON parse error") == std::string::npos ? 1 : 0;
+        }
+        return 1;
+    });
+    double seconds = 0;
+    bool rejected = bench_wait_child(pid, TIMEOUT_SECONDS, seconds);
+    std::remove(path.c_str());
+    return rejected;
+}
+
+// Shards JSONL lines that end inside an array or close it with the wrong bracket.
+inline JsonObject bench_shard_truncated_jsonl(const BPETokenizer& model) {
+    BPETokenizer with_separator = model;
+    with_separator.register_special_token("<|endoftext|>");
+    FrozenTokenizer tokenizer(with_separator);
+    ShardOptions opts;
+    opts.prefix = "/tmp/bpe-bench-" + std::to_string(::getpid()) + "-shard";
+    opts.jsonl = true;
+    auto shard = [&](const std::string& path) { write_token_shards(tokenizer, {path}, opts); };
+    bool truncated = bench_rejects_json("{\"text\": \"a\"}\n{\"meta\": [1, 2", shard);
+    bool mismatched = bench_rejects_json("{\"meta\": [1, 2}, \"text\": \"b\"}\n", shard);
+    bool missing_comma = bench_rejects_json("{\"meta\": [1 2], \"text\": \"c\"}\n", shard);
+    std::remove((opts.prefix + ".idx").c_str());
+    std::remove(ShardWriter::shard_path(opts.prefix, 0).c_str());
+    return JsonObject()
+        .str("name", "shard/truncated_jsonl")
+        .check("truncated", truncated)
+        .check("mismatched", mismatched)
+        .check("missing_comma", missing_comma);
+}
+
+// Imports tokenizer.json files cut off inside an unknown field, the merges and the added tokens.
+inline JsonObject bench_import_truncated() {
+    const std::string tokenizer_json =
+        "{\"normalizer\": null, \"pre_tokenizer\": {\"type\": \"ByteLevel\"}, "
+        "\"model\": {\"type\": \"BPE\", \"dropout\": null, \"vocab\": {\"a\": 0, \"b\": 1, \"ab\": 2}, "
+        "\"merges\": [\"a b\"]}, "
+        "\"added_tokens\": [{\"id\": 3, \"content\": \"<|endoftext|>\", \"special\": true}]}";
+    auto import = [](const std::string& path) { load_hf_tokenizer(path); };
+    bool rejected = bench_rejects_json("{\"normalizer\": [1, 2", import);
+    for (const char* cut : {"\"dropout\": nu", "\"a b\"", "\"special\": tr"}) {
+        size_t end = tokenizer_json.find(cut) + std::strlen(cut);
+        rejected = bench_rejects_json(tokenizer_json.substr(0, end), import) && rejected;
+    }
+    return JsonObject()
+        .str("name", "import/truncated_hf")
+        .check("rejected", rejected);
+}
+
+inline bool same_merges(const BPETokenizer& a, const BPETokenizer& b) {
+    std::vector<Merge> x = a.merges(), y = b.merges();
+    return std::equal(x.begin(), x.end(), y.begin(), y.end(), [](const Merge& m, const Merge& n) {
+        return m.left == n.left && m.right == n.right && m.id == n.id;
+    });
+}
+
+// Writes the results as JSON and returns false, after naming them on stderr, if any checks failed.
+inline bool run_benchmarks(const BenchOptions& opts, std::ostream& out) {
+    std::mt19937 rng(opts.seed);
+    std::string corpus = bench_load_corpus(opts, rng);
+    std::vector<JsonObject> results;
+
+    BPETokenizer tokenizer(opts.vocab_size);
+    reset_peak_rss();
+    auto start = std::chrono::steady_clock::now();
+    tokenizer.train(corpus);
+    double train_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    results.push_back(JsonObject()
+        .str("name", "train")
+        .num("corpus_bytes", corpus.size())
+        .num("merges", tokenizer.num_merges())
+        .num("seconds", train_seconds)
+        .num("merges_per_sec", tokenizer.num_merges() / train_seconds)
+        .num("peak_rss_kb", peak_rss_kb()));
+
+    BPETokenizer parallel(opts.vocab_size);
+    TrainOptions parallel_opts;
+    parallel_opts.num_threads = opts.threads;
+    start = std::chrono::steady_clock::now();
+    parallel.train(corpus, parallel_opts);
+    double parallel_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    results.push_back(JsonObject()
+        .str("name", "train/parallel_merge")
+        .num("threads", opts.threads)
+        .num("merges", parallel.num_merges())
+        .num("seconds", parallel_seconds)
+        .num("merges_per_sec", parallel.num_merges() / parallel_seconds)
+        .check("identical_merges", same_merges(parallel, tokenizer)));
+
+    const int MERGE_BATCH = 64;
+    BPETokenizer batched(opts.vocab_size);
+    TrainOptions batched_opts;
+    batched_opts.merge_batch = MERGE_BATCH;
+    start = std::chrono::steady_clock::now();
+    TrainStats batched_stats = batched.train(corpus, batched_opts);
+    double batched_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    results.push_back(JsonObject()
+        .str("name", "train/merge_batch")
+        .num("merge_batch", MERGE_BATCH)
+        .num("merges", batched_stats.merges)
+        .num("passes", batched_stats.passes)
+        .num("seconds", batched_seconds)
+        .num("merges_per_sec", batched_stats.merges / batched_seconds)
+        .check("identical_merges", same_merges(batched, tokenizer)));
+
+    results.push_back(bench_pair_counting(corpus, opts.min_seconds));
+
+    // Continues a model with half the merges: the first half is applied by the encoder, not replayed.
+    BPETokenizer continued(std::max(257, 256 + (opts.vocab_size - 256) / 2));
+    continued.train(corpus);
+    continued.set_max_vocab(opts.vocab_size);
+    start = std::chrono::steady_clock::now();
+    TrainStats continued_stats = continued.train(corpus);
+    double continued_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    results.push_back(JsonObject()
+        .str("name", "train/continue")
+        .num("initial_merges", continued.num_merges() - continued_stats.merges)
+        .num("merges", continued_stats.merges)
+        .num("seconds", continued_seconds)
+        .num("speedup_vs_full", train_seconds / continued_seconds)
+        .check("identical_merges", same_merges(continued, tokenizer)));
+
+    std::string scaling_corpus = bench_zipf_words(opts.scaling_bytes, 1 << 20, rng);
+    for (int vocab = 1024; vocab <= opts.scaling_max_vocab; vocab *= 4) {
+        BPETokenizer scaled(vocab, PreTokenizer::gpt2);
+        reset_peak_rss();
+        auto scaling_start = std::chrono::steady_clock::now();
+        scaled.train(scaling_corpus);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - scaling_start).count();
+        results.push_back(JsonObject()
+            .str("name", "train_scaling/" + std::to_string(vocab))
+            .str("pre_tokenizer", "gpt2")
+            .num("corpus_bytes", scaling_corpus.size())
+            .num("merges", scaled.num_merges())
+            .num("seconds", seconds)
+            .num("merges_per_sec", scaled.num_merges() / seconds)
+            .num("peak_rss_kb", peak_rss_kb()));
+    }
+
+    std::vector<std::pair<std::string, std::string>> inputs = {
+        {"english", repeat_to_size(corpus, opts.input_bytes)},
+        {"code", bench_code(opts.input_bytes, rng)},
+        {"cjk", bench_cjk(opts.input_bytes, rng)},
+        {"random_bytes", bench_random_bytes(opts.input_bytes, rng)},
+        {"no_whitespace", bench_no_whitespace(opts.input_bytes, rng)},
+    };
+    for (const auto& [name, input] : inputs) {
+        results.push_back(bench_encode(tokenizer, name, input, opts.min_seconds));
+    }
+    for (const auto& [name, input] : inputs) {
+        results.push_back(bench_decode(tokenizer, name, input, opts.min_seconds));
+    }
+
+    if (tokenizer.vocab_size() <= DenseMergeTable::MAX_VOCAB) {
+        BPETokenizer lookup = tokenizer;
+        for (MergeLookup mode : {MergeLookup::hash, MergeLookup::dense}) {
+            std::string mode_name = mode == MergeLookup::hash ? "hash" : "dense";
+            lookup.set_merge_lookup(mode);
+            results.push_back(bench_encode(lookup, "english/" + mode_name + "_lookup", inputs[0].second, opts.min_seconds)
+                .str("merge_lookup", mode_name));
+        }
+    }
+    results.push_back(bench_many_merges_lookup(rng));
+
+    results.push_back(bench_shared_encode(FrozenTokenizer(tokenizer), "english/shared_frozen", inputs[0].second,
+                                          opts.threads, opts.min_seconds));
+    for (const auto& [name, input] : inputs) {
+        results.push_back(bench_greedy_encode(tokenizer, name, input, opts.min_seconds));
+    }
+    BPETokenizer pretokenized(opts.vocab_size, PreTokenizer::gpt2);
+    pretokenized.train(corpus);
+    results.push_back(bench_dropout_encode(pretokenized, inputs[0].second, 0.1, opts.seed,
+                                           opts.min_seconds));
+    // Wrapped into lines so that the `none` model learns merges across newlines, where pruning used to cut.
+    std::string prune_sample = repeat_to_size(corpus, 1 << 20);
+    for (size_t pos = prune_sample.find(' ', 80); pos != std::string::npos; pos = prune_sample.find(' ', pos + 80)) {
+        prune_sample[pos] = '\n';
+    }
+    BPETokenizer wrapped(opts.vocab_size);
+    wrapped.train(prune_sample.substr(0, corpus.size()));
+    for (const BPETokenizer* model : {&wrapped, &pretokenized}) {
+        results.push_back(bench_prune_usage(*model, prune_sample, std::max(opts.threads, 4), opts.min_seconds));
+    }
+    results.push_back(bench_prune_special_space(wrapped, prune_sample.substr(0, corpus.size())));
+
+    BPETokenizer special = tokenizer;
+    std::string special_input;
+    for (int i = 0; i < opts.special_tokens; ++i) {
+        special.register_special_token("<|special_" + std::to_string(i) + "|>");
+    }
+    while (special_input.size() < opts.input_bytes) {
+        size_t pos = rng() % corpus.size();
+        special_input += corpus.substr(pos, 200);
+        if (opts.special_tokens > 0) {
+            special_input += "<|special_" + std::to_string(rng() % opts.special_tokens) + "|>";
+        }
+    }
+    results.push_back(bench_encode(special, "special_tokens", special_input, opts.min_seconds)
+        .num("special_tokens", opts.special_tokens));
+    results.push_back(bench_steady_state_allocations(FrozenTokenizer(special), special_input));
+    if (opts.special_tokens > 0) {
+        results.push_back(bench_special_policies(FrozenTokenizer(special), special_input, "<|special_0|>",
+                                                 opts.min_seconds));
+    }
+    results.push_back(bench_parallel_document(FrozenTokenizer(special), repeat_to_size(special_input, 8 << 20),
+                                              opts.threads, opts.min_seconds));
+    results.push_back(bench_stream_blocks(FrozenTokenizer(tokenizer), "none", inputs[0].second, 4096));
+    results.push_back(bench_stream_blocks(FrozenTokenizer(special), "none_special_tokens", special_input, 4096));
+    results.push_back(bench_stream_blocks(FrozenTokenizer(pretokenized), "gpt2", inputs[0].second, 4096));
+    results.push_back(bench_shard_truncated_jsonl(tokenizer));
+    results.push_back(bench_import_truncated());
+    results.push_back(bench_shm_dead_producers(FrozenTokenizer(tokenizer), inputs[0].second));
+    results.push_back(bench_shm_contention(FrozenTokenizer(tokenizer), inputs[0].second));
+    results.push_back(bench_shm_exclusive());
+
+    JsonObject config;
+    config.str("data_path", opts.data_path)
+        .num("vocab_size", opts.vocab_size)
+        .num("input_bytes", opts.input_bytes)
+        .num("special_tokens", opts.special_tokens)
+        .num("min_seconds", opts.min_seconds)
+        .num("seed", opts.seed)
+        .num("scaling_max_vocab", opts.scaling_max_vocab)
+        .num("scaling_bytes", opts.scaling_bytes)
+        .num("threads", opts.threads);
+
+    out << "{\n  \"schema\": 1,\n  \"config\": " << config.dump() << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        out << "    " << results[i].dump() << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}" << std::endl;
+
+    bool passed = true;
+    for (const JsonObject& result : results) {
+        for (const std::string& key : result.failed_checks()) {
+            std::cerr << "Check " << key << " failed: " << result.dump() << std::endl;
+            passed = false;
+        }
+    }
+    return passed;
+}
@@ -1,280 +1,851 @@
-#include <iostream>
-#include <vector>
-#include <string>
-#include <unordered_map>
-#include <algorithm>
-#include <regex>
-#include <stdexcept>
-#include <fstream>
-#include <sstream>
-
-const int MAX_VOCAB_SIZE = 1000;
-
-struct pair_hash {
-    template <class T1, class T2>
-    std::size_t operator () (const std::pair<T1, T2>& p) const {
-        auto h1 = std::hash<T1>{}(p.first);
-        auto h2 = std::hash<T2>{}(p.second);
-        return h1 ^ h2;
+#include "bpe.hpp"
+#include "bench.hpp"
+#include "embed.hpp"
+#include "import.hpp"
+#include "prune.hpp"
+#include "server.hpp"
+#include "shm.hpp"
+#include "shards.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+
+const size_t IO_BLOCK_SIZE = 1 << 20;
+const size_t STREAM_WARN_BYTES = 64 * IO_BLOCK_SIZE;
+
+const char* USAGE =
+    "Usage:\n"
+    "  bpe train  --input FILE [--vocab-size N] [--pre-tokenizer none|gpt2|cl100k] [--threads N] [--out model.bin]\n"
+    "             [--stop-early] [--min-frequency N] [--time-budget SECONDS] [--target-compression RATIO]\n"
+    "             [--merge-batch N] [--init model.bin [--merges N]] [--verbose]\n"
+    "  bpe encode --model model.bin [--input FILE] [--output FILE] [--format text|binary] [--threads N]\n"
+    "             [--dropout P] [--seed N] [--document | --lines] [--mode bpe|greedy]\n"
+    "             [--specials all|none|allowed|raise] [--allow-special TOKEN...]\n"
+    "  bpe decode --model model.bin [--input FILE] [--output FILE] [--format text|binary]\n"
+    "  bpe import (--tiktoken FILE | --gpt2 ENCODER_JSON VOCAB_BPE | --hf TOKENIZER_JSON)\n"
+    "             [--pre-tokenizer none|gpt2|cl100k] [--special TOKEN=ID...] [--out model.bin]\n"
+    "  bpe embed  --model model.bin --name NAME [--out NAME.hpp]\n"
+    "  bpe prune  --model model.bin --sample FILE [--min-count N] [--threads N] [--out pruned.bin]\n"
+    "             [--id-map FILE]\n"
+    "  bpe shard  --model model.bin --input FILE... [--jsonl] [--text-field text] [--out-prefix tokens]\n"
+    "             [--dtype uint16|uint32] [--shard-tokens N] [--direct-io] [--threads N] [--dropout P] [--seed N]\n"
+    "             [--specials none|raise]\n"
+    "  bpe serve  --model model.bin [--socket PATH] [--threads N] [--max-batch N] [--batch-wait-ms N]\n"
+    "             [--shm NAME] [--slots N] [--slot-bytes N] [--specials all|none|allowed|raise]\n"
+    "             [--allow-special TOKEN...]\n"
+    "  bpe loadgen --input FILE [--socket PATH | --shm NAME] [--op encode|decode|count] [--connections N]\n"
+    "             [--requests N]\n"
+    "  bpe bench  [--data FILE] [--vocab-size N] [--input-bytes N] [--special-tokens N] [--min-seconds S]\n"
+    "             [--seed N] [--threads N] [--out FILE]\n"
+    "\n"
+    "FILE may be '-' (the default) for stdin/stdout. encode streams its input in blocks cut at boundaries no merge or\n"
+    "special token crosses, so the ids are those of one encode of the whole input; text ids are written on one line,\n"
+    "binary ids as little-endian uint32. --document reads the whole input first and cuts it into chunks for\n"
+    "--threads, with the same ids. A model without a pre-tokenizer, or --mode greedy, can only be cut at special\n"
+    "tokens, so text without them is encoded on one thread in both modes. --lines encodes each line, including its\n"
+    "newline, independently and writes one output line per input line. shard encodes each input file (or each JSONL\n"
+    "line's text field) as one document, with special-token text in it as ordinary text (--specials raise rejects\n"
+    "it), appends <|endoftext|> after it and writes fixed-size token shards plus a document offset index. --dropout\n"
+    "skips each merge with probability P (BPE-dropout); block, line or document i is encoded with seed N + i, where\n"
+    "blocks are the streaming cuts after each MB of input. --mode greedy emits the longest vocabulary token at each\n"
+    "position instead of applying merges: much faster, but not BPE output. --specials none encodes special-token text\n"
+    "as ordinary text, raise fails on it, and allowed (implied by --allow-special, which no other policy takes) emits\n"
+    "ids only for the special tokens listed by --allow-special; on serve they apply to all client text.\n"
+    "Every command takes --instrument FILE to write counters, phase times and per-merge timings as JSON (needs a\n"
+    "build with -DBPE_INSTRUMENT=1), and --trace FILE [--perf-markers] to write a Chrome trace of its spans.\n";
+
+struct Args {
+    std::unordered_map<std::string, std::string> options;
+    std::unordered_map<std::string, std::vector<std::string>> lists;
+
+    bool has(const std::string& key) const {
+        return options.find(key) != options.end();
     }
-};
 
-std::vector<int> string_to_byte(const std::string& input, const std::string& encoding) {
-    std::vector<int> result;
-    for (unsigned char c : input) {
-        result.push_back(static_cast<int>(c));
+    std::string get(const std::string& key, const std::string& fallback = "") const {
+        auto it = options.find(key);
+        return it == options.end() ? fallback : it->second;
     }
-    return result;
-}
 
-std::pair<std::pair<int, int>, int> most_frequent_pair(const std::vector<int>& indices) {
-    std::unordered_map<std::pair<int, int>, int, pair_hash> counts;
-    for (size_t i = 0; i < indices.size() - 1; ++i) {
-        counts[{indices[i], indices[i + 1]}]++;
-    }
-    
-    if (counts.empty()) {
-        return {{-1, -1}, 0};
-    }
-    
-    auto max_element = std::max_element(
-        counts.begin(), counts.end(),
-        [](const auto& p1, const auto& p2) { return p1.second < p2.second; }
-    );
-    
-    return {max_element->first, max_element->second};
-}
-
-std::vector<int> merge_pair(const std::vector<int>& indices, const std::pair<int, int>& pair, int new_index) {
-    std::vector<int> merged;
-    size_t i = 0;
+    int get_int(const std::string& key, int fallback) const {
+        auto it = options.find(key);
+        if (it == options.end()) {
+            return fallback;
+        }
+        return parse_number<int>(key, it->second, [](const std::string& s, size_t* used) {
+            return std::stoi(s, used);
+        });
+    }
 
-    while (i < indices.size()) {
-        if (i < indices.size() - 1 && std::make_pair(indices[i], indices[i + 1]) == pair) {
-            merged.push_back(new_index);
-            i += 2;
-        } else {
-            merged.push_back(indices[i]);
-            i++;
+    // std::stoull wraps a negative value around instead of rejecting it.
+    uint64_t get_u64(const std::string& key, uint64_t fallback) const {
+        auto it = options.find(key);
+        if (it == options.end()) {
+            return fallback;
         }
+        return parse_number<uint64_t>(key, it->second, [](const std::string& s, size_t* used) {
+            return s.find('-') == std::string::npos ? std::stoull(s, used) : 0;
+        });
     }
 
-    return merged;
-}
+    int64_t get_i64(const std::string& key, int64_t fallback) const {
+        auto it = options.find(key);
+        if (it == options.end()) {
+            return fallback;
+        }
+        return parse_number<int64_t>(key, it->second, [](const std::string& s, size_t* used) {
+            return std::stoll(s, used);
+        });
+    }
 
-class BPETokenizer {
-public:
-    BPETokenizer(int max_vocab_size) : max_vocab_size(max_vocab_size) {
-        if (max_vocab_size <= 256) {
-            throw std::invalid_argument("Maximum vocabulary size must be at least 256");
+    double get_double(const std::string& key, double fallback) const {
+        auto it = options.find(key);
+        if (it == options.end()) {
+            return fallback;
         }
-        reset();
+        return parse_number<double>(key, it->second, [](const std::string& s, size_t* used) {
+            return std::stod(s, used);
+        });
+    }
+
+    std::vector<std::string> get_list(const std::string& key) const {
+        auto it = lists.find(key);
+        return it == lists.end() ? std::vector<std::string>() : it->second;
     }
 
-    void reset() {
-        pairs.clear();
-        id_to_token.clear();
-        for (int i = 0; i < 256; ++i) {
-            id_to_token[i] = std::string(1, static_cast<char>(i));
+    // Every option must be in `allowed`, and only those in `list_options` may take more than one value.
+    void check(const std::vector<std::string>& allowed, const std::vector<std::string>& list_options = {}) const {
+        for (const auto& [key, _] : options) {
+            if (std::find(allowed.begin(), allowed.end(), key) == allowed.end()) {
+                throw std::invalid_argument("Unknown option " + key);
+            }
+            if (std::find(list_options.begin(), list_options.end(), key) == list_options.end()) {
+                check_single(key);
+            }
         }
-        next_id = 256;
-        special_to_id.clear();
-        id_to_special.clear();
     }
 
-    void register_special_token(const std::string& token) {
-        if (special_to_id.find(token) == special_to_id.end()) {
-            std::cout << "Added special token " << token << " with ID " << next_id << "\n" << std::endl;
-            special_to_id[token] = next_id;
-            id_to_special[next_id] = token;
-            next_id++;
+    void check_single(const std::string& key) const {
+        auto it = lists.find(key);
+        if (it != lists.end() && it->second.size() > 1) {
+            throw std::invalid_argument(key + " takes one value, got " + std::to_string(it->second.size()));
         }
     }
 
-    void train(const std::string& input, bool stop_early = false, bool verbose = false) {
-        std::vector<int> indices = string_to_byte(input, "utf-8");
+private:
+    // The whole value must be a number: std::stoi and friends stop at the first character that is not part of one.
+    template <class T, class Parse>
+    static T parse_number(const std::string& key, const std::string& value, Parse parse) {
+        size_t used = 0;
+        try {
+            T number = parse(value, &used);
+            if (used == value.size()) {
+                return number;
+            }
+        } catch (const std::logic_error&) {
+        }
+        throw std::invalid_argument(key + " expects a number, got '" + value + "'");
+    }
+};
 
-        while (vocab_size() < max_vocab_size) {
-            auto [pair, count] = most_frequent_pair(indices);
+Args parse_args(int argc, char** argv, int first) {
+    Args args;
+    for (int i = first; i < argc; ++i) {
+        std::string key = argv[i];
+        if (key.compare(0, 2, "--") != 0) {
+            throw std::invalid_argument("Unexpected argument " + key);
+        }
+        std::vector<std::string>& values = args.lists[key];
+        while (i + 1 < argc && std::string(argv[i + 1]).compare(0, 2, "--") != 0) {
+            values.push_back(argv[++i]);
+        }
+        args.options[key] = values.empty() ? "" : values.front();
+    }
+    return args;
+}
 
-            if (pair.first == -1 && pair.second == -1) {
-                break;
+class File {
+public:
+    File(const std::string& path, bool write) {
+        if (path.empty() || path == "-") {
+            file = write ? stdout : stdin;
+            owned = false;
+        } else {
+            file = std::fopen(path.c_str(), write ? "wb" : "rb");
+            if (!file) {
+                throw std::runtime_error("Error opening " + path);
             }
+            owned = true;
+        }
+        std::setvbuf(file, nullptr, _IOFBF, IO_BLOCK_SIZE);
+    }
 
-            if (stop_early && count == 1) {
-                break;
-            }
+    ~File() {
+        if (owned) {
+            std::fclose(file);
+        } else {
+            std::fflush(file);
+        }
+    }
 
-            indices = merge_pair(indices, pair, next_id);
-            std::string new_token = id_to_token[pair.first] + id_to_token[pair.second];
-            pairs[pair] = next_id;
-            id_to_token[next_id] = new_token;
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
 
-            if (verbose) {
-                std::cout << "Merged IDs (" << pair.first << ", " << pair.second << ") as a new token \""
-                        << new_token << "\" with ID " << next_id << "\n" << std::endl;
-            }
+    size_t read(char* data, size_t size) {
+        return std::fread(data, 1, size, file);
+    }
 
-            next_id++;
+    void write(const std::string& data) {
+        if (std::fwrite(data.data(), 1, data.size(), file) != data.size()) {
+            throw std::runtime_error("Error writing output");
         }
+    }
 
-        std::cout << "Training complete: " << pairs.size() << " merges performed. Final vocabulary size: " 
-                  << vocab_size() << "\n" << std::endl;
+    std::string read_all() {
+        std::string data;
+        std::vector<char> buffer(IO_BLOCK_SIZE);
+        size_t n;
+        while ((n = read(buffer.data(), buffer.size())) > 0) {
+            data.append(buffer.data(), n);
+        }
+        return data;
     }
 
-    std::vector<int> encode(const std::string& input) {
-        std::vector<int> indices;
-        
-        if (!special_to_id.empty()) {
-            std::string pattern = "(";
-            for (const auto& [token, _] : special_to_id) {
-                if (pattern.length() > 1) pattern += "|";
-                pattern += std::regex_replace(token, std::regex("[.^$*+?()[\\]{}|]"), "\\$&");
-            }
-            pattern += ")";
-            std::regex special_pattern(pattern);
-            
-            std::sregex_token_iterator iter(input.begin(), input.end(), special_pattern, {-1, 0});
-            std::sregex_token_iterator end;
-            
-            for (; iter != end; ++iter) {
-                std::string split = *iter;
-                if (special_to_id.find(split) != special_to_id.end()) {
-                    indices.push_back(special_to_id[split]);
-                } else {
-                    auto non_special_indices = _encode_non_special(split);
-                    indices.insert(indices.end(), non_special_indices.begin(), non_special_indices.end());
-                }
-            }
+private:
+    FILE* file;
+    bool owned;
+};
+
+bool parse_format(const Args& args) {
+    std::string format = args.get("--format", "text");
+    if (format != "text" && format != "binary") {
+        throw std::invalid_argument("--format must be 'text' or 'binary'");
+    }
+    return format == "binary";
+}
+
+// --allow-special implies the `allowed` policy, and any other --specials policy would ignore its list.
+SpecialMode parse_specials(const Args& args) {
+    if (!args.has("--allow-special")) {
+        return parse_special_mode(args.get("--specials", "all"));
+    }
+    SpecialMode mode = parse_special_mode(args.get("--specials", "allowed"));
+    if (mode != SpecialMode::allowed) {
+        throw std::invalid_argument("--allow-special needs --specials allowed, not " + args.get("--specials"));
+    }
+    return mode;
+}
+
+int default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void append_ids(std::string& out, const std::vector<int>& ids, bool binary) {
+    if (binary) {
+        for (int id : ids) {
+            uint32_t value = static_cast<uint32_t>(id);
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+    } else {
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (i > 0) out += ' ';
+            out += std::to_string(ids[i]);
+        }
+        out += '\n';
+    }
+}
+
+// With `lines`, each line of the block is encoded and written on its own, and with dropout line i of the input gets
+// seed + i. Otherwise the block is a piece of the input cut where encode may split it: its ids continue the single
+// output line, and `index` is the block number, so with dropout block i gets seed + i.
+std::string encode_block(const FrozenTokenizer& tokenizer, const std::string& block, bool lines, bool binary,
+                         double dropout, uint64_t seed, uint64_t index, const SpecialPolicy& policy) {
+    TraceSpan span("encode_block", "encode");
+    span.arg("index", index);
+    span.arg("bytes", block.size());
+    std::string out;
+    std::vector<int> ids;
+    MergeDropout rng(dropout, seed);
+    auto encode = [&](std::string_view text, uint64_t number) {
+        ids.clear();
+        if (dropout > 0.0) {
+            rng.reseed(seed + number);
+            tokenizer.encode(text, ids, rng, policy);
         } else {
-            indices = _encode_non_special(input);
+            tokenizer.encode(text, ids, policy);
+        }
+    };
+    if (!lines) {
+        encode(block, index);
+        if (binary) {
+            append_ids(out, ids, true);
+            return out;
         }
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (index > 0 || i > 0) out += ' ';
+            out += std::to_string(ids[i]);
+        }
+        return out;
+    }
+    size_t pos = 0;
+    for (uint64_t line = index; pos < block.size(); ++line) {
+        size_t end = block.find('\n', pos);
+        end = end == std::string::npos ? block.size() : end + 1;
+        encode(std::string_view(block).substr(pos, end - pos), line);
+        append_ids(out, ids, binary);
+        pos = end;
+    }
+    return out;
+}
 
-        return indices;
+int cmd_train(const Args& args) {
+    args.check({"--input", "--vocab-size", "--pre-tokenizer", "--threads", "--out", "--stop-early",
+                "--min-frequency", "--time-budget", "--target-compression", "--verbose", "--merge-batch", "--init",
+                "--merges"});
+    if (!args.has("--input")) {
+        throw std::invalid_argument("train requires --input");
     }
 
-    std::string decode(const std::vector<int>& indices) {
-        std::string decoded;
+    std::string corpus = File(args.get("--input"), false).read_all();
+    if (corpus.empty()) {
+        throw std::runtime_error("Training input is empty");
+    }
+    std::cerr << "Corpus size: " << corpus.size() << " characters" << std::endl;
 
-        for (int id : indices) {
-            if (id_to_special.find(id) != id_to_special.end()) {
-                decoded += id_to_special[id];
-            } else {
-                decoded += id_to_token[id];
+    BPETokenizer tokenizer(MAX_VOCAB_SIZE);
+    if (args.has("--init")) {
+        if (args.has("--pre-tokenizer")) {
+            throw std::invalid_argument("--init uses the pre-tokenizer of the initial model");
+        }
+        tokenizer = BPETokenizer::load(args.get("--init"));
+        // Special tokens are moved past the new merges and do not count towards the vocabulary size.
+        int learned = tokenizer.special_space_start();
+        int vocab_size = args.get_int("--vocab-size", tokenizer.max_vocab());
+        if (args.has("--merges")) {
+            if (args.has("--vocab-size")) {
+                throw std::invalid_argument("--merges and --vocab-size both set the size; give one of them");
+            }
+            int merges = args.get_int("--merges", 0);
+            if (merges <= 0) {
+                throw std::invalid_argument("--merges must be positive");
             }
+            vocab_size = learned + merges;
+        } else if (vocab_size <= learned) {
+            throw std::invalid_argument("--vocab-size must exceed the initial vocabulary size of " +
+                                        std::to_string(learned));
         }
+        tokenizer.set_max_vocab(vocab_size);
+        std::cerr << "Continuing from " << tokenizer.num_merges() << " merges" << std::endl;
+    } else if (args.has("--merges")) {
+        throw std::invalid_argument("--merges needs --init");
+    } else {
+        tokenizer = BPETokenizer(args.get_int("--vocab-size", MAX_VOCAB_SIZE),
+                                 parse_pre_tokenizer(args.get("--pre-tokenizer", "none")));
+    }
+    TrainOptions opts;
+    opts.stop_early = args.has("--stop-early");
+    opts.verbose = args.has("--verbose");
+    opts.num_threads = args.get_int("--threads", default_threads());
+    opts.min_frequency = args.get_i64("--min-frequency", 0);
+    opts.time_budget_seconds = args.get_double("--time-budget", 0.0);
+    opts.target_compression = args.get_double("--target-compression", 0.0);
+    if (opts.min_frequency < 0) {
+        throw std::invalid_argument("--min-frequency must not be negative");
+    }
+    if (!(opts.time_budget_seconds >= 0.0)) {
+        throw std::invalid_argument("--time-budget must not be negative");
+    }
+    if (!(opts.target_compression >= 0.0)) {
+        throw std::invalid_argument("--target-compression must not be negative");
+    }
+    opts.merge_batch = args.get_int("--merge-batch", 1);
+    TrainStats stats = tokenizer.train(corpus, opts);
+    tokenizer.register_special_token("<|endoftext|>");
+
+    std::string out_path = args.get("--out", "model.bin");
+    tokenizer.save(out_path);
+    std::cerr << "Training complete: " << tokenizer.num_merges() << " merges performed. Final vocabulary size: "
+              << tokenizer.vocab_size() << ". Saved to " << out_path << std::endl;
+    std::cerr << "Stopped by " << stats.stop_reason << " after " << stats.seconds << " s (" << stats.passes
+              << " merge passes), compression " << stats.compression() << " bytes/token" << std::endl;
+    return 0;
+}
 
-        return decoded;
+int cmd_encode(const Args& args) {
+    args.check({"--model", "--input", "--output", "--format", "--threads", "--dropout", "--seed", "--document",
+                "--lines", "--mode", "--specials", "--allow-special"},
+               {"--allow-special"});
+    EncodeMode mode = parse_encode_mode(args.get("--mode", "bpe"));
+    FrozenTokenizer tokenizer = FrozenTokenizer::load(args.get("--model", "model.bin"), mode);
+    SpecialMode special_mode = parse_specials(args);
+    SpecialPolicy policy = tokenizer.special_policy(special_mode, args.get_list("--allow-special"));
+    bool binary = parse_format(args);
+    size_t threads = std::max(1, args.get_int("--threads", default_threads()));
+    double dropout = std::stod(args.get("--dropout", "0"));
+    uint64_t seed = args.get_u64("--seed", 0);
+    bool lines = args.has("--lines");
+    if (dropout > 0.0 && mode == EncodeMode::greedy) {
+        throw std::invalid_argument("--dropout needs --mode bpe");
+    }
+    if (lines && args.has("--document")) {
+        throw std::invalid_argument("--lines and --document exclude each other");
     }
 
-    int vocab_size() const {
-        return next_id;
+    File in(args.get("--input"), false);
+    File out(args.get("--output"), true);
+    if (args.has("--document")) {
+        if (dropout > 0.0) {
+            throw std::invalid_argument("--document does not support --dropout");
+        }
+        std::string text = in.read_all();
+        std::vector<int> ids;
+        tokenizer.encode_parallel(text, ids, static_cast<int>(threads), policy);
+        std::string encoded;
+        append_ids(encoded, ids, binary);
+        out.write(encoded);
+        return 0;
     }
+    std::deque<std::future<std::string>> pending;
+    std::vector<char> buffer(IO_BLOCK_SIZE);
+    std::string carry;
+    uint64_t index = 0;
+
+    auto submit = [&](std::string block) {
+        uint64_t first = index;
+        index += lines ? std::count(block.begin(), block.end(), '\n') : 1;
+        pending.push_back(std::async(std::launch::async, [&tokenizer, &policy, lines, binary, dropout, seed, first,
+                                                          block = std::move(block)] {
+            return encode_block(tokenizer, block, lines, binary, dropout, seed, first, policy);
+        }));
+        while (pending.size() > threads) {
+            out.write(pending.front().get());
+            pending.pop_front();
+        }
+    };
+
+    // Blocks end at the last newline or, without --lines, at the first place after the newly read data starts
+    // where the tokenizer may split the text, so the ids are those of one encode of the whole input.
+    // A model without a pre-tokenizer (or --mode greedy) can only be cut at special tokens, so text without any is
+    // buffered until the end and encoded on one thread.
+    size_t n;
+    bool warned = false;
+    while ((n = in.read(buffer.data(), buffer.size())) > 0) {
+        carry.append(buffer.data(), n);
+        size_t cut = lines ? carry.rfind('\n') + 1 : tokenizer.next_split(carry, carry.size() - n, policy, true);
+        if (cut == 0 || (!lines && cut == carry.size())) {
+            if (!lines && !warned && carry.size() >= STREAM_WARN_BYTES) {
+                std::cerr << "Warning: no place to cut the input in its first " << carry.size() / IO_BLOCK_SIZE
+                          << " MB, so it is encoded as one block on one thread; use --lines to encode lines in "
+                             "parallel" << std::endl;
+                warned = true;
+            }
+            continue;
+        }
+        std::string rest = carry.substr(cut);
+        carry.resize(cut);
+        submit(std::move(carry));
+        carry = std::move(rest);
+    }
+    if (!carry.empty()) {
+        submit(std::move(carry));
+    }
+    while (!pending.empty()) {
+        out.write(pending.front().get());
+        pending.pop_front();
+    }
+    if (!lines && !binary) {
+        out.write("\n");
+    }
+    return 0;
+}
 
-private:
-    std::vector<int> _encode_non_special(const std::string& input) {
-        std::vector<int> indices = string_to_byte(input, "utf-8");
-        
-        bool changes_made;
-        do {
-            changes_made = false;
-            for (size_t i = 0; i < indices.size() - 1; ++i) {
-                std::pair<int, int> pair = {indices[i], indices[i + 1]};
-                if (pairs.find(pair) != pairs.end()) {
-                    indices[i] = pairs[pair];
-                    indices.erase(indices.begin() + i + 1);
-                    changes_made = true;
+int cmd_decode(const Args& args) {
+    args.check({"--model", "--input", "--output", "--format"});
+    BPETokenizer tokenizer = BPETokenizer::load(args.get("--model", "model.bin"));
+    bool binary = parse_format(args);
+
+    File in(args.get("--input"), false);
+    File out(args.get("--output"), true);
+    std::vector<char> buffer(IO_BLOCK_SIZE);
+    std::string carry;
+    std::vector<int> ids;
+
+    size_t n;
+    while (true) {
+        n = in.read(buffer.data(), buffer.size());
+        carry.append(buffer.data(), n);
+        bool last = n == 0;
+
+        size_t consumed = 0;
+        if (binary) {
+            consumed = carry.size() - carry.size() % sizeof(uint32_t);
+            for (size_t i = 0; i < consumed; i += sizeof(uint32_t)) {
+                uint32_t value;
+                std::memcpy(&value, carry.data() + i, sizeof(value));
+                ids.push_back(static_cast<int>(value));
+            }
+        } else {
+            size_t pos = 0;
+            while (pos < carry.size()) {
+                if (std::isspace(static_cast<unsigned char>(carry[pos]))) {
+                    pos++;
+                    continue;
+                }
+                size_t end = pos;
+                while (end < carry.size() && std::isdigit(static_cast<unsigned char>(carry[end]))) {
+                    end++;
+                }
+                if (end == carry.size() && !last) {
+                    break;
                 }
+                if (end == pos || (end < carry.size() && !std::isspace(static_cast<unsigned char>(carry[end])))) {
+                    throw std::invalid_argument("Invalid token ID in input");
+                }
+                ids.push_back(std::stoi(carry.substr(pos, end - pos)));
+                pos = end;
             }
-        } while (changes_made);
-
-        return indices;
-    }
+            consumed = pos;
+        }
+        carry.erase(0, consumed);
 
-    int max_vocab_size;
-    std::unordered_map<std::pair<int, int>, int, pair_hash> pairs;
-    std::unordered_map<int, std::string> id_to_token;
-    int next_id;
-    std::unordered_map<std::string, int> special_to_id;
-    std::unordered_map<int, std::string> id_to_special;
-};
+        out.write(tokenizer.decode(ids));
+        ids.clear();
 
+        if (last) {
+            if (!carry.empty()) {
+                throw std::invalid_argument("Truncated token ID at end of input");
+            }
+            break;
+        }
+    }
+    return 0;
+}
 
-int main() {
-    try {
-        std::cout << "Opening file...\n" << std::endl;
-        std::ifstream file("data.txt");
-        if (!file.is_open()) {
-            std::cerr << "Error opening data.txt\n" << std::endl;
-            return 1;
+int cmd_import(const Args& args) {
+    args.check({"--tiktoken", "--gpt2", "--hf", "--pre-tokenizer", "--special", "--out"}, {"--gpt2", "--special"});
+    auto start = std::chrono::steady_clock::now();
+    std::optional<PreTokenizer> pre_tokenizer;
+    if (args.has("--pre-tokenizer")) {
+        pre_tokenizer = parse_pre_tokenizer(args.get("--pre-tokenizer"));
+    }
+    BPETokenizer tokenizer = [&] {
+        if (args.has("--tiktoken")) {
+            return load_tiktoken(args.get("--tiktoken"), pre_tokenizer.value_or(PreTokenizer::cl100k));
+        }
+        if (args.has("--gpt2")) {
+            std::vector<std::string> files = args.get_list("--gpt2");
+            if (files.size() != 2) {
+                throw std::invalid_argument("--gpt2 takes encoder.json and vocab.bpe");
+            }
+            return load_gpt2(files[0], files[1], pre_tokenizer.value_or(PreTokenizer::gpt2));
         }
-        std::cout << "File opened successfully\n" << std::endl;
+        if (args.has("--hf")) {
+            return load_hf_tokenizer(args.get("--hf"), pre_tokenizer);
+        }
+        throw std::invalid_argument("import requires --tiktoken, --gpt2 or --hf");
+    }();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const std::string& special : args.get_list("--special")) {
+        size_t eq = special.rfind('=');
+        if (eq == std::string::npos) {
+            throw std::invalid_argument("--special expects TOKEN=ID, got " + special);
+        }
+        tokenizer.add_special_token(special.substr(0, eq), std::stoi(special.substr(eq + 1)));
+    }
+
+    std::string out_path = args.get("--out", "model.bin");
+    tokenizer.save(out_path);
+    std::cerr << "Imported " << tokenizer.num_merges() << " merges, vocabulary size " << tokenizer.vocab_size()
+              << ", pre-tokenizer " << pre_tokenizer_name(tokenizer.pre_tokenizer_mode()) << " in " << seconds
+              << " s. Saved to " << out_path << std::endl;
+    return 0;
+}
 
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        std::string corpus = buffer.str();
-        file.close();
+int cmd_embed(const Args& args) {
+    args.check({"--model", "--name", "--out"});
+    if (!args.has("--model") || !args.has("--name")) {
+        throw std::invalid_argument("embed requires --model and --name");
+    }
+    BPETokenizer tokenizer = BPETokenizer::load(args.get("--model"));
+    std::string name = args.get("--name");
+    std::string out_path = args.get("--out", name + ".hpp");
+    std::ofstream out(out_path, std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Error opening " + out_path + " for writing");
+    }
+    write_embedded_header(tokenizer, out, name);
+    if (!out) {
+        throw std::runtime_error("Error writing " + out_path);
+    }
+    std::cerr << "Embedded " << tokenizer.num_merges() << " merges, vocabulary size " << tokenizer.vocab_size()
+              << " as " << name << "_tokenizer() in " << out_path << std::endl;
+    return 0;
+}
 
-        std::cout << "Corpus size: " << corpus.size() << " characters\n" << std::endl;
+// Writes the old-to-new id map as text, one "old new" line per old id; pruned ids map to -1.
+void write_id_map(const std::string& path, const std::vector<int>& id_map) {
+    std::string text;
+    for (size_t id = 0; id < id_map.size(); ++id) {
+        text += std::to_string(id) + ' ' + std::to_string(id_map[id]) + '\n';
+    }
+    File(path, true).write(text);
+}
 
-        if (corpus.empty()) {
-            std::cerr << "Error: data.txt is empty\n" << std::endl;
-            return 1;
+int cmd_prune(const Args& args) {
+    args.check({"--model", "--sample", "--min-count", "--threads", "--out", "--id-map"});
+    if (!args.has("--sample")) {
+        throw std::invalid_argument("prune requires --sample");
+    }
+    FrozenTokenizer tokenizer = FrozenTokenizer::load(args.get("--model", "model.bin"));
+    std::string sample = File(args.get("--sample"), false).read_all();
+    int threads = std::max(1, args.get_int("--threads", default_threads()));
+    int64_t min_count = std::max<int64_t>(1, args.get_u64("--min-count", 1));
+
+    std::vector<int64_t> usage = count_token_usage(tokenizer, sample, threads);
+    PrunedVocab pruned = prune_vocabulary(tokenizer.tokenizer(), usage, min_count);
+    int removed = tokenizer.vocab_size() - pruned.tokenizer.vocab_size();
+
+    std::vector<int64_t> pruned_usage = count_token_usage(FrozenTokenizer(pruned.tokenizer), sample, threads);
+    int64_t before = 0, after = 0;
+    bool unchanged = true;
+    for (size_t id = 0; id < usage.size(); ++id) {
+        before += usage[id];
+        if (pruned.id_map[id] >= 0) {
+            unchanged &= usage[id] == pruned_usage[pruned.id_map[id]];
         }
+    }
+    for (int64_t count : pruned_usage) {
+        after += count;
+    }
+    unchanged &= before == after;
 
-        BPETokenizer tokenizer(MAX_VOCAB_SIZE);
+    std::string out_path = args.get("--out", "pruned.bin");
+    pruned.tokenizer.save(out_path);
+    if (args.has("--id-map")) {
+        write_id_map(args.get("--id-map"), pruned.id_map);
+    }
+    std::cerr << "Pruned " << removed << " of " << tokenizer.vocab_size() << " tokens used fewer than " << min_count
+              << " times in " << sample.size() << " sample bytes. Vocabulary size " << pruned.tokenizer.vocab_size()
+              << ", " << pruned.tokenizer.num_merges() << " merges. Saved to " << out_path << std::endl;
+    std::cerr << "Sample tokens: " << before << " before, " << after << " after"
+              << (unchanged ? " (token counts unchanged)" : "") << std::endl;
+    return 0;
+}
 
-        std::string verbose_input;
-        bool verbose = false;
-        
-        while (true) {
-            std::cout << "Print merge information? (y/n): ";
-            
-            std::getline(std::cin, verbose_input);
+int cmd_shard(const Args& args) {
+    args.check({"--model", "--input", "--jsonl", "--text-field", "--out-prefix", "--dtype", "--shard-tokens",
+                "--direct-io", "--threads", "--dropout", "--seed", "--specials"},
+               {"--input"});
+    std::vector<std::string> inputs = args.get_list("--input");
+    if (inputs.empty()) {
+        throw std::invalid_argument("shard requires --input");
+    }
+    FrozenTokenizer tokenizer = FrozenTokenizer::load(args.get("--model", "model.bin"));
+
+    ShardOptions opts;
+    opts.prefix = args.get("--out-prefix", opts.prefix);
+    opts.jsonl = args.has("--jsonl");
+    opts.text_field = args.get("--text-field", opts.text_field);
+    opts.shard_tokens = args.get_u64("--shard-tokens", opts.shard_tokens);
+    opts.direct_io = args.has("--direct-io");
+    opts.num_threads = args.get_int("--threads", default_threads());
+    opts.dropout = std::stod(args.get("--dropout", "0"));
+    opts.seed = args.get_u64("--seed", opts.seed);
+    opts.specials = parse_special_mode(args.get("--specials", "none"));
+    std::string dtype = args.get("--dtype", "uint16");
+    if (dtype != "uint16" && dtype != "uint32") {
+        throw std::invalid_argument("--dtype must be 'uint16' or 'uint32'");
+    }
+    opts.token_bytes = dtype == "uint16" ? 2 : 4;
 
-            if (verbose_input == "y" || verbose_input == "Y") {
-                verbose = true;
-                break;
+    ShardStats stats = write_token_shards(tokenizer, inputs, opts);
+    std::cerr << "Wrote " << stats.tokens << " tokens from " << stats.documents << " documents to " << stats.shards
+              << " shards (" << opts.prefix << "_*.bin, index " << opts.prefix << ".idx)" << std::endl;
+    return 0;
+}
 
-            } else if (verbose_input == "n" || verbose_input == "N") {
-                verbose = false;
-                break;
+int cmd_serve(const Args& args) {
+    args.check({"--model", "--socket", "--threads", "--max-batch", "--batch-wait-ms", "--shm", "--slots",
+                "--slot-bytes", "--specials", "--allow-special"},
+               {"--allow-special"});
+    FrozenTokenizer tokenizer = FrozenTokenizer::load(args.get("--model", "model.bin"));
+    SpecialMode specials = parse_specials(args);
+    if (args.has("--shm")) {
+        ShmOptions opts;
+        opts.specials = specials;
+        opts.allowed_specials = args.get_list("--allow-special");
+        opts.name = args.get("--shm");
+        opts.num_threads = args.get_int("--threads", default_threads());
+        opts.num_slots = static_cast<uint32_t>(args.get_u64("--slots", opts.num_slots));
+        opts.slot_bytes = static_cast<uint32_t>(args.get_u64("--slot-bytes", opts.slot_bytes));
+        ShmTokenizerServer server(tokenizer, opts);
+        std::cerr << "Serving " << args.get("--model", "model.bin") << " on shared memory " << opts.name << " with "
+                  << opts.num_threads << " workers" << std::endl;
+        server.run();
+        return 0;
+    }
+    ServerOptions opts;
+    opts.specials = specials;
+    opts.allowed_specials = args.get_list("--allow-special");
+    opts.socket_path = args.get("--socket", opts.socket_path);
+    opts.num_threads = args.get_int("--threads", default_threads());
+    opts.max_batch = args.get_u64("--max-batch", opts.max_batch);
+    opts.batch_wait_ms = args.get_int("--batch-wait-ms", opts.batch_wait_ms);
+    TokenizerServer server(tokenizer, opts);
+    std::cerr << "Serving " << args.get("--model", "model.bin") << " on " << opts.socket_path << " with "
+              << opts.num_threads << " workers" << std::endl;
+    server.run();
+    return 0;
+}
 
-            } else {
-                std::cout << "\nInvalid input. Please enter 'y' or 'n'\n" << std::endl;
-            }
+int cmd_loadgen(const Args& args) {
+    args.check({"--input", "--socket", "--shm", "--op", "--connections", "--requests"});
+    if (!args.has("--input")) {
+        throw std::invalid_argument("loadgen requires --input");
+    }
+    LoadOptions opts;
+    opts.socket_path = args.get("--socket", opts.socket_path);
+    opts.connections = args.get_int("--connections", opts.connections);
+    opts.requests = args.get_u64("--requests", opts.requests);
+    std::string op = args.get("--op", "encode");
+    if (op == "encode") opts.op = OP_ENCODE;
+    else if (op == "decode") opts.op = OP_DECODE;
+    else if (op == "count") opts.op = OP_COUNT;
+    else throw std::invalid_argument("Unknown op " + op);
+
+    std::string text = File(args.get("--input"), false).read_all();
+    std::vector<std::string> payloads;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        end = end == std::string::npos ? text.size() : end + 1;
+        if (end - pos > 1) {
+            payloads.push_back(text.substr(pos, end - pos));
         }
+        pos = end;
+    }
 
-        tokenizer.train(corpus, false, verbose);
-
-        tokenizer.register_special_token("<|endoftext|>");
+    LoadStats stats;
+    if (args.has("--shm")) {
+        std::string name = args.get("--shm");
+        stats = run_load_generator(payloads, opts, [&] { return std::make_unique<ShmTokenizerClient>(name); });
+    } else {
+        stats = run_load_generator(payloads, opts);
+    }
+    std::cout << JsonObject()
+        .str("op", op)
+        .str("transport", args.has("--shm") ? "shm" : "socket")
+        .num("connections", opts.connections)
+        .num("requests", stats.requests)
+        .num("errors", stats.errors)
+        .num("seconds", stats.seconds)
+        .num("requests_per_sec", stats.requests / stats.seconds)
+        .num("mb_per_sec", stats.bytes / 1e6 / stats.seconds)
+        .num("p50_us", stats.p50_us)
+        .num("p99_us", stats.p99_us)
+        .num("max_us", stats.max_us)
+        .dump() << std::endl;
+    return stats.errors == 0 ? 0 : 1;
+}
 
-        std::string input;
+int cmd_bench(const Args& args) {
+    BenchOptions opts;
+    for (const auto& [key, value] : args.options) {
+        if (key != "--out" && !parse_bench_option(key, value, opts)) {
+            throw std::invalid_argument("Unknown option " + key);
+        }
+        args.check_single(key);
+    }
+    if (!args.has("--out")) {
+        return run_benchmarks(opts, std::cout) ? 0 : 1;
+    }
+    std::ofstream out(args.get("--out"));
+    if (!out.is_open()) {
+        throw std::runtime_error("Error opening " + args.get("--out"));
+    }
+    return run_benchmarks(opts, out) ? 0 : 1;
+}
 
-        while (true) {
-            std::cout << "\nEnter text to encode (or 'q' to quit): ";
-            std::getline(std::cin, input);
+int run_command(const std::string& command, const Args& args) {
+    if (command == "train") {
+        return cmd_train(args);
+    } else if (command == "encode") {
+        return cmd_encode(args);
+    } else if (command == "decode") {
+        return cmd_decode(args);
+    } else if (command == "import") {
+        return cmd_import(args);
+    } else if (command == "embed") {
+        return cmd_embed(args);
+    } else if (command == "prune") {
+        return cmd_prune(args);
+    } else if (command == "shard") {
+        return cmd_shard(args);
+    } else if (command == "serve") {
+        return cmd_serve(args);
+    } else if (command == "loadgen") {
+        return cmd_loadgen(args);
+    } else if (command == "bench") {
+        return cmd_bench(args);
+    } else if (command == "help" || command == "--help" || command == "-h") {
+        std::cout << USAGE;
+        return 0;
+    }
 
-            if (input == "q") {
-                break;
-            }
+    std::cerr << "Unknown command " << command << "\n\n" << USAGE;
+    return 1;
+}
 
-            std::vector<int> encoded = tokenizer.encode(input);
+void write_instrumentation(const std::string& path) {
+    if (!Instrumentation::enabled()) {
+        std::cerr << "Warning: built without -DBPE_INSTRUMENT=1, instrumentation is empty" << std::endl;
+    }
+    File out(path, true);
+    out.write(instrumentation_json(Instrumentation::instance().snapshot()).dump() + "\n");
+}
 
-            std::cout << "Encoded: ";
-            for (int id : encoded) {
-                std::cout << id << " ";
-            }
-            std::cout << std::endl;
+int main(int argc, char** argv) {
+    try {
+        if (argc < 2) {
+            std::cerr << USAGE;
+            return 1;
+        }
 
-            std::string decoded = tokenizer.decode(encoded);
-            std::cout << "Decoded: " << decoded << std::endl;
+        std::string command = argv[1];
+        Args args = parse_args(argc, argv, 2);
+        bool instrument = args.has("--instrument");
+        std::string instrument_path = args.get("--instrument");
+        bool trace = args.has("--trace");
+        std::string trace_path = args.get("--trace");
+        bool perf_markers = args.has("--perf-markers");
+        for (const char* key : {"--instrument", "--trace", "--perf-markers"}) {
+            args.check_single(key);
+            args.options.erase(key);
+            args.lists.erase(key);
+        }
+        if (trace && !TraceRecorder::instance().start(perf_markers)) {
+            std::cerr << "Warning: cannot open the ftrace trace_marker file, perf markers are off" << std::endl;
         }
 
-        return 0;
+        int status = run_command(command, args);
+        if (instrument) {
+            write_instrumentation(instrument_path);
+        }
+        if (trace) {
+            TraceRecorder::instance().stop();
+            std::ofstream out(trace_path);
+            if (!out.is_open()) {
+                throw std::runtime_error("Error opening " + trace_path);
+            }
+            TraceRecorder::instance().write_json(out);
+        }
+        return status;
 
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-}
\ No newline at end of file
+}
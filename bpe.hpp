@@ -0,0 +1,2611 @@
+#pragma once
+
+#include "instrument.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
+#include <regex>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstdint>
+#include <queue>
+#include <chrono>
+#include <array>
+#include <memory>
+#include <cmath>
+#include <type_traits>
+#include <map>
+#include <mutex>
+
+const int MAX_VOCAB_SIZE = 1000;
+
+struct pair_hash {
+    template <class T1, class T2>
+    std::size_t operator () (const std::pair<T1, T2>& p) const {
+        auto h1 = std::hash<T1>{}(p.first);
+        auto h2 = std::hash<T2>{}(p.second);
+        return h1 ^ (h2 + 0x9e3779b97f4a7c15ULL + (h1 << 6) + (h1 >> 2));
+    }
+};
+
+enum class PreTokenizer {
+    none,
+    gpt2,
+    cl100k,
+};
+
+inline std::string pre_tokenizer_name(PreTokenizer mode) {
+    switch (mode) {
+        case PreTokenizer::none: return "none";
+        case PreTokenizer::gpt2: return "gpt2";
+        case PreTokenizer::cl100k: return "cl100k";
+    }
+    return "unknown";
+}
+
+inline PreTokenizer parse_pre_tokenizer(const std::string& name) {
+    if (name == "none") return PreTokenizer::none;
+    if (name == "gpt2") return PreTokenizer::gpt2;
+    if (name == "cl100k") return PreTokenizer::cl100k;
+    throw std::invalid_argument("Unknown pre-tokenizer " + name);
+}
+
+enum ByteClass {
+    BYTE_SPACE,
+    BYTE_LETTER,
+    BYTE_DIGIT,
+    BYTE_OTHER,
+};
+
+inline ByteClass byte_class(unsigned char c) {
+    if (c == ' ' || (c >= '\t' && c <= '\r')) return BYTE_SPACE;
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return BYTE_LETTER;
+    if (c >= 0x80) return BYTE_LETTER;
+    if (c >= '0' && c <= '9') return BYTE_DIGIT;
+    return BYTE_OTHER;
+}
+
+inline size_t class_run_end(std::string_view text, size_t pos, ByteClass cls) {
+    while (pos < text.size() && byte_class(text[pos]) == cls) {
+        pos++;
+    }
+    return pos;
+}
+
+// GPT-2 pattern: 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+// with every non-ASCII byte treated as a letter.
+inline size_t gpt2_pre_token_end(std::string_view text, size_t pos) {
+    size_t n = text.size();
+    if (text[pos] == '\'' && pos + 1 < n) {
+        char c = text[pos + 1];
+        if (c == 's' || c == 't' || c == 'm' || c == 'd') return pos + 2;
+        if (pos + 2 < n) {
+            char d = text[pos + 2];
+            if ((c == 'r' && d == 'e') || (c == 'v' && d == 'e') || (c == 'l' && d == 'l')) return pos + 3;
+        }
+    }
+
+    ByteClass cls = byte_class(text[pos]);
+    if (cls != BYTE_SPACE) {
+        return class_run_end(text, pos, cls);
+    }
+    if (text[pos] == ' ' && pos + 1 < n && byte_class(text[pos + 1]) != BYTE_SPACE) {
+        return class_run_end(text, pos + 1, byte_class(text[pos + 1]));
+    }
+
+    size_t end = class_run_end(text, pos, BYTE_SPACE);
+    if (end == n || end - pos == 1) {
+        return end;
+    }
+    return end - 1;
+}
+
+// cl100k pattern: (?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|
+// \s*[\r\n]+|\s+(?!\S)|\s+ with every non-ASCII byte treated as a letter.
+inline size_t cl100k_pre_token_end(std::string_view text, size_t pos) {
+    size_t n = text.size();
+    if (text[pos] == '\'' && pos + 1 < n) {
+        char c = static_cast<char>(text[pos + 1] | 0x20);
+        if (c == 's' || c == 't' || c == 'm' || c == 'd') return pos + 2;
+        if (pos + 2 < n) {
+            char d = static_cast<char>(text[pos + 2] | 0x20);
+            if ((c == 'r' && d == 'e') || (c == 'v' && d == 'e') || (c == 'l' && d == 'l')) return pos + 3;
+        }
+    }
+
+    auto is_newline = [](char c) { return c == '\r' || c == '\n'; };
+    ByteClass cls = byte_class(text[pos]);
+    if (cls == BYTE_LETTER) {
+        return class_run_end(text, pos, BYTE_LETTER);
+    }
+    if (cls != BYTE_DIGIT && !is_newline(text[pos]) && pos + 1 < n && byte_class(text[pos + 1]) == BYTE_LETTER) {
+        return class_run_end(text, pos + 1, BYTE_LETTER);
+    }
+    if (cls == BYTE_DIGIT) {
+        size_t end = pos + 1;
+        while (end < n && end < pos + 3 && byte_class(text[end]) == BYTE_DIGIT) end++;
+        return end;
+    }
+    size_t start = text[pos] == ' ' && pos + 1 < n && byte_class(text[pos + 1]) == BYTE_OTHER ? pos + 1 : pos;
+    if (byte_class(text[start]) == BYTE_OTHER) {
+        size_t end = class_run_end(text, start, BYTE_OTHER);
+        while (end < n && is_newline(text[end])) end++;
+        return end;
+    }
+
+    size_t end = class_run_end(text, pos, BYTE_SPACE);
+    for (size_t i = end; i > pos; --i) {
+        if (is_newline(text[i - 1])) return i;
+    }
+    if (end == n || end - pos == 1) {
+        return end;
+    }
+    return end - 1;
+}
+
+template <class F>
+void for_each_pre_token(std::string_view text, PreTokenizer mode, F&& f) {
+    if (mode == PreTokenizer::none) {
+        if (!text.empty()) f(text);
+        return;
+    }
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = mode == PreTokenizer::gpt2 ? gpt2_pre_token_end(text, pos) : cl100k_pre_token_end(text, pos);
+        f(text.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+// A position where a pre-token always starts: a single space between two non-space bytes.
+inline size_t next_safe_split(std::string_view text, size_t pos) {
+    for (pos = std::max<size_t>(pos, 1); pos + 1 < text.size(); ++pos) {
+        if (text[pos] == ' ' && byte_class(text[pos - 1]) != BYTE_SPACE && byte_class(text[pos + 1]) != BYTE_SPACE) {
+            return pos;
+        }
+    }
+    return text.size();
+}
+
+inline uint64_t pair_key(int left, int right) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32) | static_cast<uint32_t>(right);
+}
+
+struct Merge {
+    int left;
+    int right;
+    int id;
+};
+
+// Ids below this have their pairs in PairIndex's dense table.
+const int DENSE_PAIR_IDS = 256;
+
+// Maps pair keys to slots. With the dense table on, pairs of two ids below DENSE_PAIR_IDS, which are nearly all
+// pairs while the vocabulary is still mostly bytes, are found with one array read; other pairs go to an
+// open-addressing table with linear probing and backward-shift deletion, kept at most half full.
+class PairIndex {
+public:
+    explicit PairIndex(bool dense_ids = true) {
+        if (dense_ids) {
+            dense.assign(DENSE_PAIR_IDS * DENSE_PAIR_IDS, -1);
+        }
+    }
+
+    int find(uint64_t key) const {
+        if (int d = dense_index(key); d >= 0) {
+            return dense[d];
+        }
+        if (count == 0) return -1;
+        for (size_t i = home(key);; i = (i + 1) & mask) {
+            if (slots[i] < 0) return -1;
+            if (keys[i] == key) return slots[i];
+        }
+    }
+
+    // The slot of key and false, or, if key is absent, `slot` (now stored for it) and true.
+    std::pair<int, bool> try_emplace(uint64_t key, int slot) {
+        if (int d = dense_index(key); d >= 0) {
+            if (dense[d] >= 0) return {dense[d], false};
+            dense[d] = slot;
+            dense_count++;
+            return {slot, true};
+        }
+        if (2 * (count + 1) > slots.size()) {
+            grow();
+        }
+        size_t i = home(key);
+        for (; slots[i] >= 0; i = (i + 1) & mask) {
+            if (keys[i] == key) return {slots[i], false};
+        }
+        keys[i] = key;
+        slots[i] = slot;
+        count++;
+        return {slot, true};
+    }
+
+    void erase(uint64_t key) {
+        if (int d = dense_index(key); d >= 0) {
+            if (dense[d] >= 0) dense_count--;
+            dense[d] = -1;
+            return;
+        }
+        if (count == 0) return;
+        size_t i = home(key);
+        for (; keys[i] != key || slots[i] < 0; i = (i + 1) & mask) {
+            if (slots[i] < 0) return;
+        }
+        count--;
+        for (size_t j = (i + 1) & mask; slots[j] >= 0; j = (j + 1) & mask) {
+            // An entry can fill the hole unless its home lies cyclically in (i, j].
+            size_t h = home(keys[j]);
+            if (((j - h) & mask) >= ((j - i) & mask)) {
+                keys[i] = keys[j];
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = -1;
+    }
+
+    void clear() {
+        if (dense_count > 0) {
+            std::fill(dense.begin(), dense.end(), -1);
+            dense_count = 0;
+        }
+        if (count > 0) {
+            std::fill(slots.begin(), slots.end(), -1);
+            count = 0;
+        }
+    }
+
+    size_t size() const {
+        return dense_count + count;
+    }
+
+private:
+    int dense_index(uint64_t key) const {
+        uint64_t left = key >> 32, right = key & 0xFFFFFFFF;
+        if (dense.empty() || left >= DENSE_PAIR_IDS || right >= DENSE_PAIR_IDS) return -1;
+        return static_cast<int>(left * DENSE_PAIR_IDS + right);
+    }
+
+    size_t home(uint64_t key) const {
+        return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
+
+    void grow() {
+        std::vector<uint64_t> old_keys = std::move(keys);
+        std::vector<int> old_slots = std::move(slots);
+        size_t capacity = std::max<size_t>(64, old_slots.size() * 2);
+        keys.assign(capacity, 0);
+        slots.assign(capacity, -1);
+        mask = capacity - 1;
+        shift = 64;
+        for (size_t c = capacity; c > 1; c >>= 1) {
+            shift--;
+        }
+        for (size_t j = 0; j < old_slots.size(); ++j) {
+            if (old_slots[j] < 0) continue;
+            size_t i = home(old_keys[j]);
+            while (slots[i] >= 0) {
+                i = (i + 1) & mask;
+            }
+            keys[i] = old_keys[j];
+            slots[i] = old_slots[j];
+        }
+    }
+
+    std::vector<int> dense;
+    size_t dense_count = 0;
+    std::vector<uint64_t> keys;
+    std::vector<int> slots;
+    size_t count = 0;
+    size_t mask = 0;
+    int shift = 64;
+};
+
+// Merges with at least this many recorded occurrences collect their pair-count changes locally and add them to the
+// global counts once per distinct pair, which is several times faster than updating the large pair table for every
+// occurrence. Each merge worker thread takes at least MERGE_WORKER_MIN_POSITIONS occurrences.
+const size_t MERGE_DELTA_MIN_POSITIONS = 1 << 10;
+const size_t MERGE_WORKER_MIN_POSITIONS = 1 << 13;
+
+class BPETrainer {
+public:
+    BPETrainer(const std::vector<std::pair<std::string_view, int64_t>>& words, const std::array<int, 256>& byte_ids,
+               int num_threads = 1)
+        : num_threads(std::max(1, num_threads)) {
+        TraceSpan span("init_pairs", "train");
+        size_t total = 0;
+        for (const auto& [word, _] : words) {
+            total += word.size();
+        }
+        reserve(total, words.size());
+        reserve_byte_pairs(words, byte_ids);
+        for (const auto& [word, count] : words) {
+            add_word(word.size(), count, [&](size_t i) { return byte_ids[static_cast<unsigned char>(word[i])]; });
+        }
+        build_heap();
+    }
+
+    // Starts from words that are already tokens: word i is ids[ends[i - 1] .. ends[i]) and occurs counts[i] times.
+    BPETrainer(const std::vector<int>& ids, const std::vector<size_t>& ends, const std::vector<int64_t>& counts,
+               int num_threads = 1)
+        : num_threads(std::max(1, num_threads)) {
+        TraceSpan span("init_pairs", "train");
+        reserve(ids.size(), counts.size());
+        for (size_t w = 0; w < counts.size(); ++w) {
+            size_t begin = w == 0 ? 0 : ends[w - 1];
+            add_word(ends[w] - begin, counts[w], [&](size_t i) { return ids[begin + i]; });
+        }
+        build_heap();
+    }
+
+    struct Candidate {
+        std::pair<int, int> pair;
+        int64_t count;
+    };
+
+    // The next pairs to merge, best first: up to max_pairs of them, stopping before the first pair whose left
+    // token is the right token of a pair already chosen or the other way round, and after a pair of two equal
+    // tokens. Merging such a batch in one pass gives the same merges as merging the pairs one by one. Merging
+    // (a, b) only lowers the counts of pairs (x, a) and (b, x), none of which is in the batch, so the other pairs
+    // keep their counts, and their occurrences never overlap. Each pair it creates ranks below the older pair it
+    // was cut from: (Z, x) occurs at most as often as (b, x), and (x, Z) as (x, a), and since the new token Z has
+    // the largest id, key(Z, x) > key(b, x) and key(x, Z) > key(x, a), so a tie on count breaks against the new
+    // pair. The batch is a prefix of the ranking, and those older pairs are not in it (they overlap (a, b), unless
+    // a == b == x, which ends the batch), so they rank below every later pair of the batch, and so do the new ones.
+    void best_pairs(size_t max_pairs, std::vector<Candidate>& out) {
+        out.clear();
+        std::vector<HeapEntry> chosen;
+        while (out.size() < max_pairs && !heap.empty()) {
+            HeapEntry top = heap.top();
+            int found = pair_slots.find(top.key);
+            int64_t current = found < 0 ? 0 : stats[found].count;
+            std::pair<int, int> pair = {static_cast<int>(top.key >> 32), static_cast<int>(top.key & 0xFFFFFFFF)};
+            bool duplicate = std::any_of(chosen.begin(), chosen.end(), [&](const HeapEntry& e) {
+                return e.key == top.key;
+            });
+            if (current != top.count || current == 0 || duplicate) {
+                heap.pop();
+                BPE_COUNT(COUNTER_HEAP_POPS, 1);
+                if (current > 0 && !duplicate) {
+                    heap.push({current, top.key});
+                    BPE_COUNT(COUNTER_HEAP_PUSHES, 1);
+                }
+                continue;
+            }
+            bool overlaps = std::any_of(out.begin(), out.end(), [&](const Candidate& c) {
+                return c.pair.second == pair.first || c.pair.first == pair.second;
+            });
+            if (overlaps) break;
+            heap.pop();
+            BPE_COUNT(COUNTER_HEAP_POPS, 1);
+            chosen.push_back(top);
+            out.push_back({pair, current});
+            if (pair.first == pair.second) break;
+        }
+        for (const HeapEntry& entry : chosen) {
+            heap.push(entry);
+        }
+        BPE_COUNT(COUNTER_HEAP_PUSHES, chosen.size());
+    }
+
+    // Applies a batch of merges from best_pairs in one pass over their occurrences, in position order.
+    void merge(const std::vector<Merge>& batch) {
+        std::vector<uint64_t> occurrences;
+        for (size_t m = 0; m < batch.size(); ++m) {
+            uint64_t key = pair_key(batch[m].left, batch[m].right);
+            int slot = pair_slots.find(key);
+            if (slot < 0) continue;
+            for (int p : stats[slot].positions) {
+                occurrences.push_back(static_cast<uint64_t>(p) << 32 | m);
+            }
+            stats[slot] = PairStat();
+            pair_slots.erase(key);
+        }
+        std::sort(occurrences.begin(), occurrences.end());
+
+        touched.clear();
+        if (occurrences.size() >= MERGE_DELTA_MIN_POSITIONS) {
+            merge_with_deltas(occurrences, batch);
+        } else {
+            for (uint64_t o : occurrences) {
+                live_symbols -= merge_at(o, batch, [&](int left, int right, int64_t delta, int position) {
+                    int slot = add_pair(left, right, delta, position);
+                    if (position >= 0) touched.push_back(slot);
+                });
+            }
+        }
+
+        for (int slot : touched) {
+            heap.push({stats[slot].count, stats[slot].key});
+        }
+        BPE_COUNT(COUNTER_HEAP_PUSHES, touched.size());
+    }
+
+    int64_t num_symbols() const {
+        return live_symbols;
+    }
+
+private:
+    void reserve(size_t total, size_t num_words) {
+        symbols.reserve(total);
+        prev.reserve(total);
+        next.reserve(total);
+        word_of.reserve(total);
+        word_counts.reserve(num_words);
+    }
+
+    // Counts the byte pairs in a dense histogram first, so each pair's position list is allocated once at its
+    // final size instead of growing occurrence by occurrence.
+    void reserve_byte_pairs(const std::vector<std::pair<std::string_view, int64_t>>& words,
+                            const std::array<int, 256>& byte_ids) {
+        if (*std::max_element(byte_ids.begin(), byte_ids.end()) >= DENSE_PAIR_IDS) return;
+        std::vector<uint32_t> histogram(256 * 256, 0);
+        for (const auto& [word, _] : words) {
+            for (size_t i = 1; i < word.size(); ++i) {
+                histogram[static_cast<unsigned char>(word[i - 1]) << 8 | static_cast<unsigned char>(word[i])]++;
+            }
+        }
+        for (int pair = 0; pair < 256 * 256; ++pair) {
+            if (histogram[pair] == 0) continue;
+            int slot = pair_slot(pair_key(byte_ids[pair >> 8], byte_ids[pair & 0xFF]));
+            stats[slot].positions.reserve(stats[slot].positions.size() + histogram[pair]);
+        }
+    }
+
+    template <class SymbolAt>
+    void add_word(size_t length, int64_t count, SymbolAt symbol_at) {
+        int start = static_cast<int>(symbols.size());
+        int word_index = static_cast<int>(word_counts.size());
+        word_counts.push_back(count);
+        for (size_t i = 0; i < length; ++i) {
+            int pos = start + static_cast<int>(i);
+            symbols.push_back(symbol_at(i));
+            prev.push_back(i == 0 ? -1 : pos - 1);
+            next.push_back(i + 1 == length ? -1 : pos + 1);
+            word_of.push_back(word_index);
+            live_symbols += count;
+            if (i > 0) {
+                add_pair(symbols[pos - 1], symbols[pos], count, pos - 1);
+            }
+        }
+    }
+
+    void build_heap() {
+        for (const PairStat& stat : stats) {
+            heap.push({stat.count, stat.key});
+        }
+        BPE_COUNT(COUNTER_HEAP_PUSHES, stats.size());
+    }
+
+    struct PairStat {
+        uint64_t key = 0;
+        int64_t count = 0;
+        std::vector<int> positions;
+    };
+
+    struct HeapEntry {
+        int64_t count;
+        uint64_t key;
+
+        bool operator<(const HeapEntry& other) const {
+            return count < other.count || (count == other.count && key > other.key);
+        }
+    };
+
+    // Pair-count changes made by one merge worker, kept in the order the pairs were first seen.
+    struct PairDeltas {
+        struct Delta {
+            uint64_t key;
+            int64_t count;
+            std::vector<int> positions;
+        };
+
+        void add(int left, int right, int64_t delta, int position) {
+            BPE_COUNT(COUNTER_PAIR_UPDATES, 1);
+            uint64_t key = pair_key(left, right);
+            auto [slot, inserted] = index.try_emplace(key, static_cast<int>(deltas.size()));
+            if (inserted) {
+                deltas.push_back({key, 0, {}});
+            }
+            Delta& entry = deltas[slot];
+            entry.count += delta;
+            if (position >= 0) {
+                entry.positions.push_back(position);
+            }
+        }
+
+        void clear() {
+            index.clear();
+            deltas.clear();
+            merged = 0;
+        }
+
+        PairIndex index{false};
+        std::vector<Delta> deltas;
+        int64_t merged = 0;
+    };
+
+    static int occurrence_position(uint64_t occurrence) {
+        return static_cast<int>(occurrence >> 32);
+    }
+
+    // True if the recorded occurrence (position << 32 | merge index) is still an occurrence of its pair.
+    bool live_occurrence(uint64_t occurrence, const std::vector<Merge>& batch) const {
+        int p = occurrence_position(occurrence);
+        const Merge& merge = batch[occurrence & 0xFFFFFFFF];
+        return symbols[p] == merge.left && next[p] >= 0 && symbols[next[p]] == merge.right;
+    }
+
+    // Merges the occurrence if it is still there and reports every pair-count change to update(left, right, delta,
+    // position), with position -1 for decrements. Returns the weight of the merged occurrence, or 0.
+    template <class Update>
+    int64_t merge_at(uint64_t occurrence, const std::vector<Merge>& batch, Update&& update) {
+        if (!live_occurrence(occurrence, batch)) return 0;
+        int p = occurrence_position(occurrence);
+        const Merge& merge = batch[occurrence & 0xFFFFFFFF];
+        uint64_t key = pair_key(merge.left, merge.right);
+        int q = next[p];
+
+        int64_t w = word_counts[word_of[p]];
+        int l = prev[p];
+        int r = next[q];
+        if (l >= 0 && pair_key(symbols[l], merge.left) != key) {
+            update(symbols[l], merge.left, -w, -1);
+        }
+        if (r >= 0 && pair_key(merge.right, symbols[r]) != key) {
+            update(merge.right, symbols[r], -w, -1);
+        }
+
+        symbols[p] = merge.id;
+        symbols[q] = -1;
+        next[p] = r;
+        if (r >= 0) prev[r] = p;
+
+        if (l >= 0) update(symbols[l], merge.id, w, l);
+        if (r >= 0) update(merge.id, symbols[r], w, p);
+        return w;
+    }
+
+    // Splits the live occurrences between workers. A merge at p reads and writes only p's neighbours, so workers
+    // cannot interfere as long as no cut falls between two occurrences within two symbols of each other. Each
+    // worker collects its pair-count changes locally; they are then added to the global counts worker by worker,
+    // which gives the same counts, positions and heap entries as the serial loop.
+    void merge_with_deltas(std::vector<uint64_t>& occurrences, const std::vector<Merge>& batch) {
+        occurrences.erase(std::remove_if(occurrences.begin(), occurrences.end(),
+                                         [&](uint64_t o) { return !live_occurrence(o, batch); }),
+                          occurrences.end());
+        occurrences.erase(std::unique(occurrences.begin(), occurrences.end()), occurrences.end());
+
+        size_t workers = std::clamp<size_t>(occurrences.size() / MERGE_WORKER_MIN_POSITIONS, 1, num_threads);
+        std::vector<size_t> bounds = {0};
+        for (size_t w = 1; w < workers; ++w) {
+            size_t i = std::max(bounds.back(), occurrences.size() * w / workers);
+            while (i > 0 && i < occurrences.size()) {
+                int p = occurrence_position(occurrences[i]);
+                int q = next[occurrence_position(occurrences[i - 1])];
+                if (p != q && p != next[q]) break;
+                ++i;
+            }
+            bounds.push_back(i);
+        }
+        bounds.push_back(occurrences.size());
+
+        worker_deltas.resize(std::max(worker_deltas.size(), workers));
+        auto apply_range = [&](size_t w) {
+            TraceSpan span("merge_worker", "train");
+            span.arg("occurrences", bounds[w + 1] - bounds[w]);
+            PairDeltas& local = worker_deltas[w];
+            local.clear();
+            for (size_t i = bounds[w]; i < bounds[w + 1]; ++i) {
+                local.merged += merge_at(occurrences[i], batch, [&](int left, int right, int64_t delta, int position) {
+                    local.add(left, right, delta, position);
+                });
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t w = 1; w < workers; ++w) {
+            threads.emplace_back(apply_range, w);
+        }
+        apply_range(0);
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        for (size_t w = 0; w < workers; ++w) {
+            live_symbols -= worker_deltas[w].merged;
+            for (PairDeltas::Delta& delta : worker_deltas[w].deltas) {
+                int slot = pair_slot(delta.key);
+                PairStat& stat = stats[slot];
+                stat.count += delta.count;
+                if (!delta.positions.empty()) {
+                    stat.positions.insert(stat.positions.end(), delta.positions.begin(), delta.positions.end());
+                    touched.push_back(slot);
+                }
+            }
+        }
+    }
+
+    int pair_slot(uint64_t key) {
+        auto [slot, inserted] = pair_slots.try_emplace(key, static_cast<int>(stats.size()));
+        if (inserted) {
+            stats.emplace_back();
+            stats.back().key = key;
+        }
+        return slot;
+    }
+
+    int add_pair(int left, int right, int64_t delta, int position) {
+        BPE_COUNT(COUNTER_PAIR_UPDATES, 1);
+        int slot = pair_slot(pair_key(left, right));
+        PairStat& stat = stats[slot];
+        stat.count += delta;
+        if (position >= 0) {
+            stat.positions.push_back(position);
+        }
+        return slot;
+    }
+
+    std::vector<int> symbols;
+    std::vector<int> prev;
+    std::vector<int> next;
+    std::vector<int> word_of;
+    std::vector<int64_t> word_counts;
+    int64_t live_symbols = 0;
+    PairIndex pair_slots;
+    std::vector<PairStat> stats;
+    std::priority_queue<HeapEntry> heap;
+    std::vector<int> touched;
+    int num_threads;
+    std::vector<PairDeltas> worker_deltas;
+};
+
+inline std::vector<std::pair<std::string_view, int64_t>> count_pre_tokens(std::string_view input, PreTokenizer mode,
+                                                                         int num_threads) {
+    if (mode == PreTokenizer::none) {
+        if (input.empty()) return {};
+        return {{input, 1}};
+    }
+
+    using WordCounts = std::unordered_map<std::string_view, int64_t>;
+    size_t workers = std::max<size_t>(1, std::min<size_t>(num_threads, input.size() / (1 << 20)));
+    std::vector<size_t> bounds = {0};
+    for (size_t w = 1; w < workers; ++w) {
+        bounds.push_back(std::max(bounds.back(), next_safe_split(input, input.size() * w / workers)));
+    }
+    bounds.push_back(input.size());
+
+    std::vector<WordCounts> partial(workers);
+    auto count_range = [&](size_t w) {
+        TraceSpan span("count_pre_tokens", "train");
+        span.arg("bytes", bounds[w + 1] - bounds[w]);
+        for_each_pre_token(input.substr(bounds[w], bounds[w + 1] - bounds[w]), mode,
+                           [&](std::string_view word) { partial[w][word]++; });
+    };
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; ++w) {
+        threads.emplace_back(count_range, w);
+    }
+    count_range(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (size_t w = 1; w < workers; ++w) {
+        for (const auto& [word, count] : partial[w]) {
+            partial[0][word] += count;
+        }
+    }
+    return {partial[0].begin(), partial[0].end()};
+}
+
+struct TrainOptions {
+    bool stop_early = false;
+    bool verbose = false;
+    int num_threads = 1;
+    int64_t min_frequency = 0;
+    double time_budget_seconds = 0.0;
+    double target_compression = 0.0;
+    // Up to this many merges that provably do not interact are applied per pass (see BPETrainer::best_pairs); the
+    // merges are the same as with 1. Ignored with target_compression, which is checked after every merge.
+    int merge_batch = 1;
+};
+
+struct TrainStats {
+    int merges = 0;
+    int passes = 0;
+    int64_t input_bytes = 0;
+    int64_t tokens = 0;
+    double seconds = 0.0;
+    std::string stop_reason;
+
+    double compression() const {
+        return tokens > 0 ? static_cast<double>(input_bytes) / tokens : 0.0;
+    }
+};
+
+// Read-only array that either owns its elements or borrows static storage, e.g. tables compiled into the binary.
+// Borrowed tables are copied on the first modification.
+template <class T>
+class Table {
+public:
+    Table() = default;
+
+    Table(const T* data, size_t size) : borrowed(true), items(data), count(size) {}
+
+    explicit Table(std::vector<T> values) : owned(std::move(values)) {
+        rebind();
+    }
+
+    Table(const Table& other) {
+        *this = other;
+    }
+
+    Table(Table&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    Table& operator=(const Table& other) {
+        owned = other.owned;
+        borrowed = other.borrowed;
+        items = other.items;
+        count = other.count;
+        rebind();
+        return *this;
+    }
+
+    Table& operator=(Table&& other) noexcept {
+        owned = std::move(other.owned);
+        borrowed = other.borrowed;
+        items = other.items;
+        count = other.count;
+        rebind();
+        other.rebind();
+        return *this;
+    }
+
+    const T& operator[](size_t i) const {
+        return items[i];
+    }
+
+    const T* data() const {
+        return items;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    const T& back() const {
+        return items[count - 1];
+    }
+
+    void push_back(const T& value) {
+        own().push_back(value);
+        rebind();
+    }
+
+    void append(const T* values, size_t n) {
+        own().insert(owned.end(), values, values + n);
+        rebind();
+    }
+
+    void assign(size_t n, const T& value) {
+        borrowed = false;
+        owned.assign(n, value);
+        rebind();
+    }
+
+    void clear() {
+        assign(0, T());
+    }
+
+    void resize(size_t n) {
+        own().resize(n);
+        rebind();
+    }
+
+private:
+    std::vector<T>& own() {
+        if (borrowed) {
+            owned.assign(items, items + count);
+            borrowed = false;
+        }
+        return owned;
+    }
+
+    void rebind() {
+        if (!borrowed) {
+            items = owned.data();
+            count = owned.size();
+        }
+    }
+
+    std::vector<T> owned;
+    bool borrowed = false;
+    const T* items = nullptr;
+    size_t count = 0;
+};
+
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+inline size_t reduce_range(uint32_t hash, size_t n) {
+    return static_cast<size_t>((static_cast<uint64_t>(hash) * n) >> 32);
+}
+
+// Minimal perfect hash over the merge pairs (CHD: hash, displace and compress). Keys are split into buckets of
+// about four; each bucket stores the seed that places all of its keys in free slots. A lookup is one bucket read,
+// one slot read and a key compare.
+class MergeHash {
+public:
+    static const size_t KEYS_PER_BUCKET = 4;
+
+    MergeHash() = default;
+
+    MergeHash(Table<uint32_t> seeds, Table<uint64_t> keys, Table<int32_t> ids)
+        : seeds(std::move(seeds)), keys(std::move(keys)), ids(std::move(ids)) {
+        if (this->keys.size() != this->ids.size() || (!this->keys.empty() && this->seeds.empty())) {
+            throw std::invalid_argument("Merge hash tables are inconsistent");
+        }
+    }
+
+    static MergeHash build(const std::vector<Merge>& merges) {
+        size_t n = merges.size();
+        if (n == 0) {
+            return MergeHash();
+        }
+        size_t num_buckets = (n + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET;
+        std::vector<uint64_t> hashes(n);
+        std::vector<uint32_t> bucket_start(num_buckets + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            hashes[i] = mix64(pair_key(merges[i].left, merges[i].right));
+            bucket_start[bucket_of(hashes[i], num_buckets) + 1]++;
+        }
+        for (size_t b = 0; b < num_buckets; ++b) {
+            bucket_start[b + 1] += bucket_start[b];
+        }
+        std::vector<uint32_t> members(n);
+        std::vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+        for (size_t i = 0; i < n; ++i) {
+            members[fill[bucket_of(hashes[i], num_buckets)]++] = static_cast<uint32_t>(i);
+        }
+        std::vector<uint32_t> order(num_buckets);
+        for (size_t b = 0; b < num_buckets; ++b) {
+            order[b] = static_cast<uint32_t>(b);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+        });
+
+        std::vector<uint32_t> seeds(num_buckets, 0);
+        std::vector<uint64_t> keys(n, 0);
+        std::vector<int32_t> ids(n, -1);
+        std::vector<size_t> slots;
+        for (uint32_t b : order) {
+            if (bucket_start[b] == bucket_start[b + 1]) {
+                break;
+            }
+            for (uint32_t m = bucket_start[b]; m < bucket_start[b + 1]; ++m) {
+                for (uint32_t k = bucket_start[b]; k < m; ++k) {
+                    if (hashes[members[k]] == hashes[members[m]]) {
+                        throw std::invalid_argument("Duplicate merge (" + std::to_string(merges[members[m]].left) +
+                                                    ", " + std::to_string(merges[members[m]].right) + ")");
+                    }
+                }
+            }
+            for (uint32_t seed = 0;; ++seed) {
+                slots.clear();
+                for (uint32_t m = bucket_start[b]; m < bucket_start[b + 1]; ++m) {
+                    size_t slot = slot_of(hashes[members[m]], seed, n);
+                    if (ids[slot] >= 0 || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                        break;
+                    }
+                    slots.push_back(slot);
+                }
+                if (slots.size() == bucket_start[b + 1] - bucket_start[b]) {
+                    for (size_t k = 0; k < slots.size(); ++k) {
+                        const Merge& merge = merges[members[bucket_start[b] + k]];
+                        keys[slots[k]] = pair_key(merge.left, merge.right);
+                        ids[slots[k]] = merge.id;
+                    }
+                    seeds[b] = seed;
+                    break;
+                }
+                if (seed == UINT32_MAX) {
+                    throw std::runtime_error("Merge hash construction failed");
+                }
+            }
+        }
+        return MergeHash(Table<uint32_t>(std::move(seeds)), Table<uint64_t>(std::move(keys)),
+                         Table<int32_t>(std::move(ids)));
+    }
+
+    int find(int left, int right) const {
+        if (keys.empty()) {
+            return -1;
+        }
+        uint64_t key = pair_key(left, right);
+        uint64_t hash = mix64(key);
+        size_t slot = slot_of(hash, seeds[bucket_of(hash, seeds.size())], keys.size());
+        return keys[slot] == key ? ids[slot] : -1;
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    // True if every stored id is below next_id and every merge's pair resolves to its id; a table read from a file
+    // is only used if it passes.
+    bool agrees_with(const std::vector<Merge>& merges, int next_id) const {
+        if (keys.size() != merges.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (ids[i] < 0 || ids[i] >= next_id) return false;
+        }
+        for (const Merge& merge : merges) {
+            if (find(merge.left, merge.right) != merge.id) return false;
+        }
+        return true;
+    }
+
+    const Table<uint32_t>& seed_table() const {
+        return seeds;
+    }
+
+    const Table<uint64_t>& key_table() const {
+        return keys;
+    }
+
+    const Table<int32_t>& id_table() const {
+        return ids;
+    }
+
+private:
+    static size_t bucket_of(uint64_t hash, size_t num_buckets) {
+        return reduce_range(static_cast<uint32_t>(hash >> 32), num_buckets);
+    }
+
+    static size_t slot_of(uint64_t hash, uint32_t seed, size_t n) {
+        return reduce_range(static_cast<uint32_t>(mix64(hash + seed)), n);
+    }
+
+    Table<uint32_t> seeds;
+    Table<uint64_t> keys;
+    Table<int32_t> ids;
+};
+
+// Merge lookup for small vocabularies. Each left token that starts a merge has a row with one bit per right
+// token; the merged ids are stored in (left, right) order, and a row word's rank plus the popcount of the bits
+// below the right token gives the index of its id. A lookup is three array reads with no search or hashing.
+class DenseMergeTable {
+public:
+    static const int MAX_VOCAB = 4096;
+
+    DenseMergeTable() = default;
+
+    DenseMergeTable(std::vector<Merge> merges, int vocab_size)
+        : words((vocab_size + 63) / 64), row_of(vocab_size, NO_ROW) {
+        if (vocab_size > MAX_VOCAB) {
+            throw std::invalid_argument("Dense merge table supports at most " + std::to_string(MAX_VOCAB) +
+                                        " tokens");
+        }
+        std::sort(merges.begin(), merges.end(), [](const Merge& a, const Merge& b) {
+            return a.left < b.left || (a.left == b.left && a.right < b.right);
+        });
+        size_t rows = 0;
+        for (const Merge& merge : merges) {
+            if (row_of[merge.left] == NO_ROW) {
+                row_of[merge.left] = static_cast<uint16_t>(rows++);
+                bits.resize(rows * words, 0);
+            }
+            bits[row_of[merge.left] * words + merge.right / 64] |= 1ULL << (merge.right % 64);
+            ids.push_back(static_cast<uint16_t>(merge.id));
+        }
+        rank.resize(bits.size());
+        uint32_t count = 0;
+        for (size_t w = 0; w < bits.size(); ++w) {
+            rank[w] = count;
+            count += static_cast<uint32_t>(__builtin_popcountll(bits[w]));
+        }
+    }
+
+    int find(int left, int right) const {
+        if (static_cast<size_t>(left) >= row_of.size() || static_cast<size_t>(right) >= row_of.size() ||
+            row_of[left] == NO_ROW) {
+            return -1;
+        }
+        size_t w = row_of[left] * words + right / 64;
+        uint64_t bit = 1ULL << (right % 64);
+        if (!(bits[w] & bit)) {
+            return -1;
+        }
+        return ids[rank[w] + __builtin_popcountll(bits[w] & (bit - 1))];
+    }
+
+    bool empty() const {
+        return row_of.empty();
+    }
+
+private:
+    static const uint16_t NO_ROW = 0xffff;
+
+    size_t words = 0;
+    std::vector<uint16_t> row_of;
+    std::vector<uint64_t> bits;
+    // A vocabulary of at most MAX_VOCAB tokens can still have more than 65535 merges (tiktoken imports derive one
+    // per split of a token), so the prefix counts need 32 bits.
+    std::vector<uint32_t> rank;
+    std::vector<uint16_t> ids;
+};
+
+enum class MergeLookup {
+    hash,
+    dense,
+};
+
+// Finds special tokens in text: the leftmost match, and the longest special token at that position. Candidates are
+// grouped by their first byte, so positions whose byte starts no special token are skipped with one table read.
+class SpecialMatcher {
+public:
+    SpecialMatcher() = default;
+
+    explicit SpecialMatcher(const std::unordered_map<std::string, int>& specials) {
+        for (const auto& [token, id] : specials) {
+            if (!token.empty()) {
+                entries.push_back({token, id});
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            unsigned char x = a.token[0], y = b.token[0];
+            return x < y || (x == y && a.token.size() > b.token.size());
+        });
+        first_start.fill(0);
+        for (const Entry& entry : entries) {
+            first_start[static_cast<unsigned char>(entry.token[0]) + 1]++;
+            max_length = std::max(max_length, entry.token.size());
+        }
+        for (int b = 0; b < 256; ++b) {
+            first_start[b + 1] += first_start[b];
+        }
+    }
+
+    bool find(std::string_view text, size_t pos, size_t& start, size_t& length, int& id) const {
+        if (entries.empty()) {
+            return false;
+        }
+        for (; pos < text.size(); ++pos) {
+            unsigned char b = text[pos];
+            for (uint32_t e = first_start[b]; e < first_start[b + 1]; ++e) {
+                const std::string& token = entries[e].token;
+                if (text.compare(pos, token.size(), token) == 0) {
+                    start = pos;
+                    length = token.size();
+                    id = entries[e].id;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // True if an occurrence of any special token starts before `cut` and ends after it. Cutting anywhere else
+    // leaves the leftmost-longest matches on both sides unchanged.
+    bool straddles(std::string_view text, size_t cut) const {
+        for (size_t pos = cut > max_length ? cut - max_length + 1 : 0; pos < cut; ++pos) {
+            unsigned char b = text[pos];
+            for (uint32_t e = first_start[b]; e < first_start[b + 1]; ++e) {
+                const std::string& token = entries[e].token;
+                if (token.size() > cut - pos && text.compare(pos, token.size(), token) == 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    size_t max_token_length() const {
+        return max_length;
+    }
+
+private:
+    struct Entry {
+        std::string token;
+        int id;
+    };
+
+    std::vector<Entry> entries;
+    std::array<uint32_t, 257> first_start{};
+    size_t max_length = 0;
+};
+
+// Bump allocator for per-call working memory. reset() makes all of it reusable; blocks retired while growing are
+// freed there, so after the largest request has been seen once allocate() never calls malloc again.
+class ScratchArena {
+public:
+    template <class T>
+    T* allocate(size_t n) {
+        size_t offset = (used + alignof(T) - 1) / alignof(T) * alignof(T);
+        if (offset + n * sizeof(T) > capacity) {
+            grow(n * sizeof(T) + alignof(T));
+            offset = (used + alignof(T) - 1) / alignof(T) * alignof(T);
+        }
+        used = offset + n * sizeof(T);
+        return reinterpret_cast<T*>(block.get() + offset);
+    }
+
+    void reset() {
+        retired.clear();
+        used = 0;
+    }
+
+    size_t size() const {
+        return capacity;
+    }
+
+private:
+    void grow(size_t bytes) {
+        BPE_COUNT(COUNTER_ARENA_ALLOCATIONS, 1);
+        if (block) {
+            retired.push_back(std::move(block));
+        }
+        capacity = std::max({bytes, capacity * 2, static_cast<size_t>(4096)});
+        block.reset(new char[capacity]);
+        used = 0;
+    }
+
+    std::unique_ptr<char[]> block;
+    std::vector<std::unique_ptr<char[]>> retired;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+// Working memory for encoding one piece at a time; keep one per thread and pass it to the encode overloads that
+// take it, or use the thread-local one behind the other overloads.
+struct EncodeScratch {
+    ScratchArena arena;
+    // Position buckets for long pieces, cleared but not freed between pieces.
+    std::vector<std::vector<int>> rank_buckets;
+};
+
+// Pieces at least this long, and at least as long as the vocabulary, are merged with a bucket per merge id rather
+// than a heap (see BPETokenizer::merge_by_rank).
+const size_t RANK_BUCKET_MIN_PIECE = 1 << 10;
+
+// xoshiro256** seeded through splitmix64: four words of state, a few cycles per draw.
+class Xoshiro256 {
+public:
+    explicit Xoshiro256(uint64_t seed) {
+        for (uint64_t& word : state) {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t state[4];
+};
+
+// BPE-dropout: while encoding, each applicable merge is skipped with the given probability and becomes eligible
+// again after the next merge that goes through. Not thread-safe; keep one per thread, and reseed per document when
+// the output has to be reproducible regardless of how documents are spread over threads.
+class MergeDropout {
+public:
+    MergeDropout(double probability, uint64_t seed) : rng(seed) {
+        if (!(probability >= 0.0 && probability <= 1.0)) {
+            throw std::invalid_argument("Dropout probability must be between 0 and 1");
+        }
+        threshold = probability >= 1.0 ? UINT64_MAX : static_cast<uint64_t>(std::ldexp(probability, 64));
+    }
+
+    void reseed(uint64_t seed) {
+        rng = Xoshiro256(seed);
+    }
+
+    bool drop() {
+        return rng.next() < threshold;
+    }
+
+private:
+    Xoshiro256 rng;
+    uint64_t threshold;
+};
+
+struct EmbeddedSpecial {
+    const char* token;
+    size_t size;
+    int id;
+};
+
+// Static tables written by write_embedded_header (embed.hpp). BPETokenizer(const EmbeddedModel&) borrows them.
+struct EmbeddedModel {
+    PreTokenizer pre_tokenizer;
+    int max_vocab_size;
+    int vocab_size;
+    const char* vocab_bytes;
+    const uint32_t* vocab_offsets;
+    const int* byte_ids;
+    const uint32_t* merge_seeds;
+    size_t num_merge_buckets;
+    const uint64_t* merge_keys;
+    const int32_t* merge_ids;
+    size_t num_merges;
+    const EmbeddedSpecial* specials;
+    size_t num_specials;
+    // 0 in headers written before it was emitted.
+    int special_space;
+};
+
+template <class T>
+void write_pod(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T>
+T read_pod(std::istream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) {
+        throw std::runtime_error("Unexpected end of model file");
+    }
+    return value;
+}
+
+const uint32_t MODEL_MAGIC = 0x31455042;
+const uint32_t MODEL_MAGIC_V2 = 0x32455042;
+const uint32_t SECTION_VOCAB = 0x42434F56;
+const uint32_t SECTION_BYTES = 0x45545942;
+const uint32_t SECTION_MERGE_HASH = 0x4648504D;
+const uint32_t SECTION_SPECIAL_SPACE = 0x43455053;
+
+class BPETokenizer {
+public:
+    BPETokenizer(int max_vocab_size, PreTokenizer pre_tokenizer = PreTokenizer::none)
+        : max_vocab_size(max_vocab_size), pre_tokenizer(pre_tokenizer) {
+        if (max_vocab_size <= 256) {
+            throw std::invalid_argument("Maximum vocabulary size must be at least 256");
+        }
+        reset();
+    }
+
+    explicit BPETokenizer(const EmbeddedModel& model)
+        : max_vocab_size(model.max_vocab_size),
+          pre_tokenizer(model.pre_tokenizer),
+          merge_hash(Table<uint32_t>(model.merge_seeds, model.num_merge_buckets),
+                     Table<uint64_t>(model.merge_keys, model.num_merges),
+                     Table<int32_t>(model.merge_ids, model.num_merges)),
+          vocab_bytes(model.vocab_bytes, model.vocab_offsets[model.vocab_size]),
+          vocab_offsets(model.vocab_offsets, model.vocab_size + 1),
+          next_id(model.vocab_size) {
+        std::copy(model.byte_ids, model.byte_ids + 256, byte_ids.begin());
+        for (size_t i = 0; i < model.num_specials; ++i) {
+            std::string token(model.specials[i].token, model.specials[i].size);
+            special_to_id[token] = model.specials[i].id;
+            id_to_special[model.specials[i].id] = token;
+        }
+        special_space = model.special_space >= 256 && model.special_space <= next_id ? model.special_space
+                                                                                     : learned_end();
+        specials_changed();
+    }
+
+    void reset() {
+        pairs.clear();
+        merge_hash = MergeHash();
+        dense_merges = DenseMergeTable();
+        vocab_bytes.clear();
+        vocab_offsets.assign(1, 0);
+        for (int i = 0; i < 256; ++i) {
+            append_token(std::string(1, static_cast<char>(i)));
+            byte_ids[i] = i;
+        }
+        next_id = 256;
+        special_space = 256;
+        special_to_id.clear();
+        id_to_special.clear();
+        specials_changed();
+    }
+
+    // Ids from special_space_start() up form the special-token space after the learned vocabulary. Tokens
+    // registered here take the next id in it, and train() moves the whole space up past the merges it learns, so
+    // registering before or after training gives the same ids.
+    int register_special_token(const std::string& token) {
+        auto it = special_to_id.find(token);
+        if (it != special_to_id.end()) {
+            return it->second;
+        }
+        int id = next_id++;
+        set_special(token, id);
+        append_token("");
+        specials_changed();
+        return id;
+    }
+
+    // A special token at an explicit id. Ids below special_space_start(), such as those from reserve_special_ids,
+    // are fixed; ids in the special space move with it.
+    void add_special_token(const std::string& token, int id) {
+        if (id < 0) {
+            throw std::invalid_argument("Special token ID must be non-negative");
+        }
+        while (next_id <= id) {
+            append_token("");
+            next_id++;
+        }
+        set_special(token, id);
+        specials_changed();
+    }
+
+    // Reserves count empty ids at the end of the learned vocabulary, before the special space, for special tokens
+    // whose ids must not move. Returns the first reserved id.
+    int reserve_special_ids(int count) {
+        SpecialSpace space = detach_special_space();
+        int first = next_id;
+        for (int i = 0; i < count; ++i) {
+            append_token("");
+        }
+        next_id += count;
+        attach_special_space(space);
+        return first;
+    }
+
+    int special_space_start() const {
+        return special_space;
+    }
+
+    // O(1): a flag per id, so decode only looks up the token text of ids that are special.
+    bool is_special(int id) const {
+        return id >= 0 && static_cast<size_t>(id) < special_ids.size() && special_ids[id];
+    }
+
+    // A tokenizer over the given tables. The special space starts at `special_space`, or after the last token with
+    // text if that is -1.
+    static BPETokenizer from_tables(PreTokenizer pre_tokenizer, std::vector<char> vocab_bytes,
+                                    std::vector<uint32_t> vocab_offsets, const std::array<int, 256>& byte_ids,
+                                    const std::vector<Merge>& merges, int special_space = -1) {
+        int vocab_size = static_cast<int>(vocab_offsets.size()) - 1;
+        if (vocab_size < 256 || vocab_offsets.front() != 0 || vocab_offsets.back() != vocab_bytes.size()) {
+            throw std::invalid_argument("Vocabulary tables are inconsistent");
+        }
+        BPETokenizer tokenizer(std::max(vocab_size, 257), pre_tokenizer);
+        tokenizer.vocab_bytes = Table<char>(std::move(vocab_bytes));
+        tokenizer.vocab_offsets = Table<uint32_t>(std::move(vocab_offsets));
+        tokenizer.next_id = vocab_size;
+        for (int b = 0; b < 256; ++b) {
+            if (byte_ids[b] < 0 || byte_ids[b] >= vocab_size) {
+                throw std::invalid_argument("Missing token for byte " + std::to_string(b));
+            }
+        }
+        tokenizer.byte_ids = byte_ids;
+        for (const Merge& merge : merges) {
+            if (merge.id >= vocab_size || merge.left < 0 || merge.left >= merge.id || merge.right < 0 ||
+                merge.right >= merge.id) {
+                throw std::invalid_argument("Merge (" + std::to_string(merge.left) + ", " +
+                                            std::to_string(merge.right) + ") -> " + std::to_string(merge.id) +
+                                            " is not in rank order");
+            }
+            tokenizer.pairs[{merge.left, merge.right}] = merge.id;
+        }
+        tokenizer.special_space = special_space >= 256 && special_space <= vocab_size ? special_space
+                                                                                      : tokenizer.learned_end();
+        tokenizer.freeze();
+        return tokenizer;
+    }
+
+    TrainStats train(const std::string& input, bool stop_early = false, bool verbose = false) {
+        TrainOptions opts;
+        opts.stop_early = stop_early;
+        opts.verbose = verbose;
+        return train(input, opts);
+    }
+
+    TrainStats train(const std::string& input, const TrainOptions& opts) {
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                    std::chrono::duration<double>(opts.time_budget_seconds));
+        BPE_NAMED_PHASE(timer, PHASE_TRAIN_COUNT);
+        auto words = count_pre_tokens(input, pre_tokenizer, opts.num_threads);
+        BPE_NEXT_PHASE(timer, PHASE_TRAIN_INIT);
+        BPETrainer trainer = initial_trainer(words, opts.num_threads);
+        thaw();
+        SpecialSpace special_space = detach_special_space();
+        BPE_NEXT_PHASE(timer, PHASE_TRAIN_MERGE);
+        TraceSpan merge_span("merge_loop", "train");
+        MergeBatchTrace batch_trace;
+        TrainStats stats;
+        for (const auto& [word, count] : words) {
+            stats.input_bytes += static_cast<int64_t>(word.size()) * count;
+        }
+        int64_t target_tokens = opts.target_compression > 0.0
+                                    ? static_cast<int64_t>(stats.input_bytes / opts.target_compression)
+                                    : 0;
+        stats.stop_reason = "vocab_size";
+
+        size_t batch_size = opts.target_compression > 0.0 ? 1 : std::max(1, opts.merge_batch);
+        std::vector<BPETrainer::Candidate> candidates;
+        std::vector<Merge> batch;
+
+        while (vocab_size() < max_vocab_size) {
+            BPE_INSTRUMENTED(uint64_t merge_start = instrument_now_ns();)
+            batch_trace.begin(next_id);
+            if (opts.time_budget_seconds > 0.0 && stats.passes % 16 == 0 &&
+                std::chrono::steady_clock::now() >= deadline) {
+                stats.stop_reason = "time_budget";
+                break;
+            }
+
+            if (trainer.num_symbols() <= target_tokens) {
+                stats.stop_reason = "compression";
+                break;
+            }
+
+            trainer.best_pairs(std::min<size_t>(batch_size, max_vocab_size - vocab_size()), candidates);
+            if (candidates.empty()) {
+                stats.stop_reason = "no_pairs";
+                break;
+            }
+            batch_trace.picked();
+
+            std::string stop_reason;
+            batch.clear();
+            for (const auto& candidate : candidates) {
+                if (opts.stop_early && candidate.count == 1) {
+                    stop_reason = "stop_early";
+                    break;
+                }
+                if (candidate.count < opts.min_frequency) {
+                    stop_reason = "min_frequency";
+                    break;
+                }
+                int id = next_id + static_cast<int>(batch.size());
+                batch.push_back({candidate.pair.first, candidate.pair.second, id});
+            }
+
+            if (!batch.empty()) {
+                trainer.merge(batch);
+                stats.passes++;
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                std::pair<int, int> pair = {batch[i].left, batch[i].right};
+                std::string new_token = std::string(token(pair.first)) + std::string(token(pair.second));
+                pairs[pair] = next_id;
+                append_token(new_token);
+
+                if (opts.verbose) {
+                    std::cout << "Merged IDs (" << pair.first << ", " << pair.second << ") as a new token \""
+                            << new_token << "\" with ID " << next_id << "\n" << std::endl;
+                }
+
+                BPE_INSTRUMENTED(Instrumentation::instance().record_merge(
+                    {next_id, candidates[i].count, (instrument_now_ns() - merge_start) / batch.size()});)
+                next_id++;
+                stats.merges++;
+            }
+            batch_trace.applied(static_cast<int>(batch.size()));
+
+            if (!stop_reason.empty()) {
+                stats.stop_reason = stop_reason;
+                break;
+            }
+        }
+
+        merge_span.arg("merges", stats.merges);
+        attach_special_space(special_space);
+        freeze();
+        stats.tokens = trainer.num_symbols();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    // Moves the merges into a minimal perfect hash. Encoding only looks merges up, so this is done after training
+    // and loading; the next train() call moves them back into the pair map.
+    void freeze() {
+        TraceSpan span("freeze", "model");
+        if (!pairs.empty()) {
+            merge_hash = MergeHash::build(merges());
+            pairs.clear();
+        }
+        set_merge_lookup(vocab_size() <= DenseMergeTable::MAX_VOCAB ? MergeLookup::dense : MergeLookup::hash);
+    }
+
+    bool frozen() const {
+        return pairs.empty();
+    }
+
+    // Small vocabularies (up to DenseMergeTable::MAX_VOCAB tokens) use the dense table by default.
+    void set_merge_lookup(MergeLookup lookup) {
+        if (lookup == MergeLookup::dense) {
+            if (!frozen()) {
+                throw std::logic_error("Dense merge lookup requires a frozen tokenizer");
+            }
+            dense_merges = DenseMergeTable(merges(), vocab_size());
+        } else {
+            dense_merges = DenseMergeTable();
+        }
+    }
+
+    MergeLookup merge_lookup() const {
+        return dense_merges.empty() ? MergeLookup::hash : MergeLookup::dense;
+    }
+
+    int special_token_id(const std::string& token) const {
+        auto it = special_to_id.find(token);
+        return it == special_to_id.end() ? -1 : it->second;
+    }
+
+    std::vector<int> encode(const std::string& input) const {
+        BPE_PHASE(PHASE_SPECIAL_SPLIT);
+        std::vector<int> indices;
+        std::string_view text = input;
+        size_t pos = 0, start, length;
+        int id;
+        while (special_matcher.find(text, pos, start, length, id)) {
+            encode_ordinary(text.substr(pos, start - pos), indices);
+            BPE_COUNT(COUNTER_BYTES_IN, length);
+            BPE_COUNT(COUNTER_TOKENS_OUT, 1);
+            indices.push_back(id);
+            pos = start + length;
+        }
+        encode_ordinary(text.substr(pos), indices);
+        return indices;
+    }
+
+    // Encodes text without looking for special tokens, appending the ids to out.
+    void encode_ordinary(std::string_view input, std::vector<int>& out) const {
+        thread_local EncodeScratch scratch;
+        encode_ordinary(input, out, scratch);
+    }
+
+    void encode_ordinary(std::string_view input, std::vector<int>& out, EncodeScratch& scratch) const {
+        BPE_PHASE(PHASE_PRE_TOKENIZE);
+        BPE_COUNT(COUNTER_BYTES_IN, input.size());
+        for_each_pre_token(input, pre_tokenizer,
+                           [&](std::string_view piece) { _encode_piece(piece, out, scratch, NoDropout()); });
+    }
+
+    // Stochastic encoding with BPE-dropout; with probability 0 this matches encode_ordinary.
+    void encode_ordinary(std::string_view input, std::vector<int>& out, EncodeScratch& scratch,
+                         MergeDropout& dropout) const {
+        BPE_PHASE(PHASE_PRE_TOKENIZE);
+        BPE_COUNT(COUNTER_BYTES_IN, input.size());
+        for_each_pre_token(input, pre_tokenizer,
+                           [&](std::string_view piece) { _encode_piece(piece, out, scratch, dropout); });
+    }
+
+    std::string decode(const std::vector<int>& indices) const {
+        std::string decoded;
+
+        for (int id : indices) {
+            if (id < 0 || id >= next_id) {
+                throw std::invalid_argument("Unknown token ID " + std::to_string(id));
+            }
+            if (is_special(id)) {
+                decoded += id_to_special.find(id)->second;
+            } else {
+                decoded += token(id);
+            }
+        }
+
+        return decoded;
+    }
+
+    int vocab_size() const {
+        return next_id;
+    }
+
+    int max_vocab() const {
+        return max_vocab_size;
+    }
+
+    // Lets a trained or loaded model grow: the next train() call learns merges until this size.
+    void set_max_vocab(int size) {
+        if (size <= 256) {
+            throw std::invalid_argument("Maximum vocabulary size must be at least 256");
+        }
+        max_vocab_size = size;
+    }
+
+    size_t num_merges() const {
+        return pairs.size() + merge_hash.size();
+    }
+
+    std::vector<Merge> merges() const {
+        std::vector<Merge> list;
+        for (const auto& [pair, id] : pairs) {
+            list.push_back({pair.first, pair.second, id});
+        }
+        for (size_t i = 0; i < merge_hash.size(); ++i) {
+            uint64_t key = merge_hash.key_table()[i];
+            list.push_back({static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffff), merge_hash.id_table()[i]});
+        }
+        std::sort(list.begin(), list.end(), [](const Merge& a, const Merge& b) { return a.id < b.id; });
+        return list;
+    }
+
+    const std::unordered_map<std::string, int>& special_tokens() const {
+        return special_to_id;
+    }
+
+    // Rebuilt when a special token is added, not per encode call.
+    const SpecialMatcher& special_token_matcher() const {
+        return special_matcher;
+    }
+
+    const std::array<int, 256>& byte_table() const {
+        return byte_ids;
+    }
+
+    PreTokenizer pre_tokenizer_mode() const {
+        return pre_tokenizer;
+    }
+
+    std::string_view token(int id) const {
+        return std::string_view(vocab_bytes.data() + vocab_offsets[id], vocab_offsets[id + 1] - vocab_offsets[id]);
+    }
+
+    void save(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary);
+        if (!out.is_open()) {
+            throw std::runtime_error("Error opening " + path + " for writing");
+        }
+
+        std::vector<Merge> merges = this->merges();
+
+        write_pod(out, MODEL_MAGIC_V2);
+        write_pod<int32_t>(out, max_vocab_size);
+        write_pod<int32_t>(out, next_id);
+        write_pod<uint32_t>(out, static_cast<uint32_t>(pre_tokenizer));
+        write_pod<uint32_t>(out, merges.size());
+        for (const Merge& merge : merges) {
+            write_pod<int32_t>(out, merge.left);
+            write_pod<int32_t>(out, merge.right);
+            write_pod<int32_t>(out, merge.id);
+        }
+        write_pod<uint32_t>(out, special_to_id.size());
+        for (const auto& [token, id] : special_to_id) {
+            write_pod<int32_t>(out, id);
+            write_pod<uint32_t>(out, token.size());
+            out.write(token.data(), token.size());
+        }
+
+        write_pod<uint32_t>(out, frozen() ? 4 : 3);
+        write_pod(out, SECTION_VOCAB);
+        write_pod<uint64_t>(out, vocab_bytes.size() + vocab_offsets.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char*>(vocab_offsets.data()), vocab_offsets.size() * sizeof(uint32_t));
+        out.write(vocab_bytes.data(), vocab_bytes.size());
+        write_pod(out, SECTION_BYTES);
+        write_pod<uint64_t>(out, sizeof(byte_ids));
+        out.write(reinterpret_cast<const char*>(byte_ids.data()), sizeof(byte_ids));
+        write_pod(out, SECTION_SPECIAL_SPACE);
+        write_pod<uint64_t>(out, sizeof(int32_t));
+        write_pod<int32_t>(out, special_space);
+        if (frozen()) {
+            const MergeHash& hash = merge_hash;
+            write_pod(out, SECTION_MERGE_HASH);
+            write_pod<uint64_t>(out, sizeof(uint64_t) + hash.seed_table().size() * sizeof(uint32_t) +
+                                         hash.size() * (sizeof(uint64_t) + sizeof(int32_t)));
+            write_pod<uint64_t>(out, hash.seed_table().size());
+            out.write(reinterpret_cast<const char*>(hash.seed_table().data()),
+                      hash.seed_table().size() * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(hash.key_table().data()), hash.size() * sizeof(uint64_t));
+            out.write(reinterpret_cast<const char*>(hash.id_table().data()), hash.size() * sizeof(int32_t));
+        }
+
+        if (!out) {
+            throw std::runtime_error("Error writing " + path);
+        }
+    }
+
+    static BPETokenizer load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) {
+            throw std::runtime_error("Error opening " + path);
+        }
+        uint32_t magic = read_pod<uint32_t>(in);
+        if (magic != MODEL_MAGIC && magic != MODEL_MAGIC_V2) {
+            throw std::runtime_error(path + " is not a BPE model file");
+        }
+
+        BPETokenizer tokenizer(read_pod<int32_t>(in));
+        int saved_next_id = read_pod<int32_t>(in);
+        if (magic == MODEL_MAGIC_V2) {
+            uint32_t mode = read_pod<uint32_t>(in);
+            if (mode > static_cast<uint32_t>(PreTokenizer::cl100k)) {
+                throw std::runtime_error("Corrupt model file " + path + ": unknown pre-tokenizer");
+            }
+            tokenizer.pre_tokenizer = static_cast<PreTokenizer>(mode);
+        }
+
+        std::vector<Merge> merges(read_pod<uint32_t>(in));
+        for (Merge& merge : merges) {
+            merge.left = read_pod<int32_t>(in);
+            merge.right = read_pod<int32_t>(in);
+            merge.id = read_pod<int32_t>(in);
+            if (merge.id >= saved_next_id || merge.left < 0 || merge.left >= merge.id || merge.right < 0 ||
+                merge.right >= merge.id) {
+                throw std::runtime_error("Corrupt model file " + path + ": merge references unknown ID");
+            }
+        }
+        uint32_t num_special = read_pod<uint32_t>(in);
+        for (uint32_t i = 0; i < num_special; ++i) {
+            int id = read_pod<int32_t>(in);
+            std::string token(read_pod<uint32_t>(in), '\0');
+            if (!in.read(&token[0], token.size())) {
+                throw std::runtime_error("Unexpected end of model file");
+            }
+            tokenizer.special_to_id[token] = id;
+            tokenizer.id_to_special[id] = token;
+        }
+        int special_space = -1;
+        bool has_vocab = false;
+        bool has_hash = false;
+        if (magic == MODEL_MAGIC_V2) {
+            uint32_t num_sections = read_pod<uint32_t>(in);
+            for (uint32_t i = 0; i < num_sections; ++i) {
+                uint32_t tag = read_pod<uint32_t>(in);
+                uint64_t size = read_pod<uint64_t>(in);
+                if (tag == SECTION_VOCAB) {
+                    size_t offsets_size = (static_cast<size_t>(saved_next_id) + 1) * sizeof(uint32_t);
+                    if (size < offsets_size) {
+                        throw std::runtime_error("Corrupt model file " + path + ": bad vocab section");
+                    }
+                    std::vector<uint32_t> offsets(saved_next_id + 1);
+                    std::vector<char> bytes(size - offsets_size);
+                    in.read(reinterpret_cast<char*>(offsets.data()), offsets_size);
+                    in.read(bytes.data(), bytes.size());
+                    if (!in || offsets.front() != 0 || offsets.back() != bytes.size() ||
+                        !std::is_sorted(offsets.begin(), offsets.end())) {
+                        throw std::runtime_error("Corrupt model file " + path + ": bad vocab section");
+                    }
+                    tokenizer.vocab_offsets = Table<uint32_t>(std::move(offsets));
+                    tokenizer.vocab_bytes = Table<char>(std::move(bytes));
+                    has_vocab = true;
+                } else if (tag == SECTION_BYTES && size == sizeof(tokenizer.byte_ids)) {
+                    in.read(reinterpret_cast<char*>(tokenizer.byte_ids.data()), size);
+                    for (int id : tokenizer.byte_ids) {
+                        if (in && (id < 0 || id >= saved_next_id)) {
+                            throw std::runtime_error("Corrupt model file " + path + ": bad byte section");
+                        }
+                    }
+                } else if (tag == SECTION_SPECIAL_SPACE && size == sizeof(int32_t)) {
+                    special_space = read_pod<int32_t>(in);
+                } else if (tag == SECTION_MERGE_HASH) {
+                    uint64_t num_buckets = read_pod<uint64_t>(in);
+                    uint64_t table_size = merges.size() * (sizeof(uint64_t) + sizeof(int32_t));
+                    if (num_buckets > size || size != sizeof(uint64_t) + num_buckets * sizeof(uint32_t) + table_size ||
+                        (num_buckets == 0) != merges.empty()) {
+                        throw std::runtime_error("Corrupt model file " + path + ": bad merge hash section");
+                    }
+                    std::vector<uint32_t> seeds(num_buckets);
+                    std::vector<uint64_t> keys(merges.size());
+                    std::vector<int32_t> ids(merges.size());
+                    in.read(reinterpret_cast<char*>(seeds.data()), seeds.size() * sizeof(uint32_t));
+                    in.read(reinterpret_cast<char*>(keys.data()), keys.size() * sizeof(uint64_t));
+                    in.read(reinterpret_cast<char*>(ids.data()), ids.size() * sizeof(int32_t));
+                    if (!in) {
+                        throw std::runtime_error("Unexpected end of model file");
+                    }
+                    tokenizer.merge_hash = MergeHash(Table<uint32_t>(std::move(seeds)),
+                                                     Table<uint64_t>(std::move(keys)), Table<int32_t>(std::move(ids)));
+                    has_hash = tokenizer.merge_hash.agrees_with(merges, saved_next_id);
+                } else {
+                    in.seekg(size, std::ios::cur);
+                }
+            }
+            if (!in) {
+                throw std::runtime_error("Unexpected end of model file");
+            }
+        }
+
+        if (!has_vocab) {
+            std::vector<std::pair<int, int>> merge_of(std::max(saved_next_id, 256), {-1, -1});
+            for (const Merge& merge : merges) {
+                merge_of[merge.id] = {merge.left, merge.right};
+            }
+            for (int id = 256; id < saved_next_id; ++id) {
+                auto [left, right] = merge_of[id];
+                if (left >= 0) {
+                    tokenizer.append_token(std::string(tokenizer.token(left)) + std::string(tokenizer.token(right)));
+                } else {
+                    tokenizer.append_token("");
+                }
+            }
+        }
+        if (!has_hash) {
+            tokenizer.merge_hash = MergeHash::build(merges);
+        }
+        tokenizer.next_id = saved_next_id;
+        tokenizer.freeze();
+        tokenizer.special_space = special_space >= 0 && special_space <= saved_next_id ? special_space
+                                                                                       : tokenizer.learned_end();
+        tokenizer.specials_changed();
+        return tokenizer;
+    }
+
+private:
+    int merge_id(int left, int right) const {
+        if (!dense_merges.empty()) {
+            BPE_COUNT(COUNTER_DENSE_HITS, 1);
+            return dense_merges.find(left, right);
+        }
+        BPE_COUNT(COUNTER_HASH_PROBES, 1);
+        if (merge_hash.size() > 0) {
+            return merge_hash.find(left, right);
+        }
+        auto merge = pairs.find({left, right});
+        return merge == pairs.end() ? -1 : merge->second;
+    }
+
+    struct NoDropout {
+        bool drop() const {
+            return false;
+        }
+    };
+
+    // Applies the merges lowest id first, leftmost first among equal ids, as long as the piece has a mergeable pair.
+    template <class Dropout>
+    void merge_by_heap(int* symbols, int* prev, int* next, int n, EncodeScratch& scratch, Dropout&& dropout) const {
+        using Candidate = std::pair<int, int>;
+        constexpr bool stochastic = !std::is_same<std::decay_t<Dropout>, NoDropout>::value;
+        // At most n - 1 initial candidates plus two per merge, counting the ones set aside by dropout.
+        Candidate* heap = scratch.arena.allocate<Candidate>(3 * static_cast<size_t>(n));
+        Candidate* heap_end = heap;
+        Candidate* skipped = stochastic ? scratch.arena.allocate<Candidate>(3 * static_cast<size_t>(n)) : nullptr;
+        Candidate* skipped_end = skipped;
+        auto push = [&](int id, int pos) {
+            BPE_COUNT(COUNTER_HEAP_PUSHES, 1);
+            *heap_end++ = {id, pos};
+            std::push_heap(heap, heap_end, std::greater<Candidate>());
+        };
+
+        for (int i = 0; i + 1 < n; ++i) {
+            int id = merge_id(symbols[i], symbols[i + 1]);
+            if (id >= 0) *heap_end++ = {id, i};
+        }
+        std::make_heap(heap, heap_end, std::greater<Candidate>());
+        BPE_COUNT(COUNTER_HEAP_PUSHES, heap_end - heap);
+
+        while (heap_end != heap) {
+            BPE_COUNT(COUNTER_HEAP_POPS, 1);
+            std::pop_heap(heap, heap_end, std::greater<Candidate>());
+            auto [id, p] = *--heap_end;
+            int q = next[p];
+            if (symbols[p] < 0 || q < 0 || merge_id(symbols[p], symbols[q]) != id) {
+                continue;
+            }
+            if constexpr (stochastic) {
+                if (dropout.drop()) {
+                    *skipped_end++ = {id, p};
+                    continue;
+                }
+                for (Candidate* c = skipped; c != skipped_end; ++c) {
+                    push(c->first, c->second);
+                }
+                skipped_end = skipped;
+            }
+            symbols[p] = id;
+            symbols[q] = -1;
+            next[p] = next[q];
+            if (next[p] >= 0) prev[next[p]] = p;
+
+            if (prev[p] >= 0) {
+                int left = merge_id(symbols[prev[p]], id);
+                if (left >= 0) push(left, prev[p]);
+            }
+            if (next[p] >= 0) {
+                int right = merge_id(id, symbols[next[p]]);
+                if (right >= 0) push(right, p);
+            }
+        }
+    }
+
+    // The same merges in the same order as merge_by_heap, with a bucket of positions per merge id in place of the
+    // heap. A merge only creates pairs with higher ids than its own, since a merge's id is above the ids of its
+    // parts, so the buckets can be drained in id order, each sorted by position. This avoids the heap's cache
+    // misses on long pieces, such as whole documents with the `none` pre-tokenizer.
+    void merge_by_rank(int* symbols, int* prev, int* next, int n, std::vector<std::vector<int>>& buckets) const {
+        if (buckets.size() < static_cast<size_t>(next_id)) {
+            buckets.resize(next_id);
+        }
+        int lowest = next_id;
+        auto push = [&](int id, int pos) {
+            BPE_COUNT(COUNTER_HEAP_PUSHES, 1);
+            buckets[id].push_back(pos);
+            lowest = std::min(lowest, id);
+        };
+        for (int i = 0; i + 1 < n; ++i) {
+            int id = merge_id(symbols[i], symbols[i + 1]);
+            if (id >= 0) push(id, i);
+        }
+
+        for (int id = lowest; id < next_id; ++id) {
+            std::vector<int>& bucket = buckets[id];
+            std::sort(bucket.begin(), bucket.end());
+            for (int p : bucket) {
+                BPE_COUNT(COUNTER_HEAP_POPS, 1);
+                int q = next[p];
+                if (symbols[p] < 0 || q < 0 || merge_id(symbols[p], symbols[q]) != id) {
+                    continue;
+                }
+                symbols[p] = id;
+                symbols[q] = -1;
+                next[p] = next[q];
+                if (next[p] >= 0) prev[next[p]] = p;
+
+                if (prev[p] >= 0) {
+                    int left = merge_id(symbols[prev[p]], id);
+                    if (left >= 0) push(left, prev[p]);
+                }
+                if (next[p] >= 0) {
+                    int right = merge_id(id, symbols[next[p]]);
+                    if (right >= 0) push(right, p);
+                }
+            }
+            bucket.clear();
+        }
+    }
+
+    template <class Dropout>
+    void _encode_piece(std::string_view piece, std::vector<int>& out, EncodeScratch& scratch, Dropout&& dropout) const {
+        constexpr bool stochastic = !std::is_same<std::decay_t<Dropout>, NoDropout>::value;
+        BPE_NAMED_PHASE(timer, PHASE_MERGE);
+        int n = static_cast<int>(piece.size());
+        scratch.arena.reset();
+        int* symbols = scratch.arena.allocate<int>(n);
+        int* prev = scratch.arena.allocate<int>(n);
+        int* next = scratch.arena.allocate<int>(n);
+        for (int i = 0; i < n; ++i) {
+            symbols[i] = byte_ids[static_cast<unsigned char>(piece[i])];
+            prev[i] = i - 1;
+            next[i] = i + 1 < n ? i + 1 : -1;
+        }
+        if (!stochastic && static_cast<size_t>(n) >= RANK_BUCKET_MIN_PIECE && n >= next_id) {
+            merge_by_rank(symbols, prev, next, n, scratch.rank_buckets);
+        } else {
+            merge_by_heap(symbols, prev, next, n, scratch, dropout);
+        }
+
+        BPE_NEXT_PHASE(timer, PHASE_OUTPUT);
+        BPE_INSTRUMENTED(size_t tokens_before = out.size();)
+        for (int i = 0; i >= 0 && n > 0; i = next[i]) {
+            out.push_back(symbols[i]);
+        }
+        BPE_COUNT(COUNTER_TOKENS_OUT, out.size() - tokens_before);
+    }
+
+    // Training starts from the words split into bytes, or, if the tokenizer already has merges, from the words
+    // encoded with them: a model trained on one corpus then learns its next merges on another. The distinct words
+    // are encoded in parallel, each thread into its own buffer.
+    BPETrainer initial_trainer(const std::vector<std::pair<std::string_view, int64_t>>& words, int num_threads) const {
+        if (num_merges() == 0) {
+            return BPETrainer(words, byte_ids, num_threads);
+        }
+        TraceSpan span("encode_words", "train");
+        span.arg("words", words.size());
+        size_t workers = std::max<size_t>(1, std::min<size_t>(num_threads, words.size() / 1024));
+        std::vector<std::vector<int>> ids(workers);
+        std::vector<std::vector<size_t>> ends(workers);
+        auto encode_range = [&](size_t w) {
+            EncodeScratch scratch;
+            for (size_t i = words.size() * w / workers; i < words.size() * (w + 1) / workers; ++i) {
+                _encode_piece(words[i].first, ids[w], scratch, NoDropout());
+                ends[w].push_back(ids[w].size());
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t w = 1; w < workers; ++w) {
+            threads.emplace_back(encode_range, w);
+        }
+        encode_range(0);
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (size_t w = 1; w < workers; ++w) {
+            size_t offset = ids[0].size();
+            ids[0].insert(ids[0].end(), ids[w].begin(), ids[w].end());
+            for (size_t end : ends[w]) {
+                ends[0].push_back(offset + end);
+            }
+        }
+        std::vector<int64_t> counts;
+        counts.reserve(words.size());
+        for (const auto& [_, count] : words) {
+            counts.push_back(count);
+        }
+        return BPETrainer(ids[0], ends[0], counts, num_threads);
+    }
+
+    // The special tokens in the special space, by offset from its start, and its size.
+    struct SpecialSpace {
+        std::vector<std::pair<int, std::string>> tokens;
+        int size = 0;
+    };
+
+    // Takes the special space off the end of the vocabulary, so new ids go to the learned vocabulary.
+    SpecialSpace detach_special_space() {
+        SpecialSpace space;
+        space.size = next_id - special_space;
+        for (int id = special_space; id < next_id; ++id) {
+            auto special = id_to_special.find(id);
+            if (special != id_to_special.end()) {
+                space.tokens.push_back({id - special_space, special->second});
+                special_to_id.erase(special->second);
+                id_to_special.erase(special);
+            }
+        }
+        vocab_offsets.resize(special_space + 1);
+        next_id = special_space;
+        return space;
+    }
+
+    // Puts the special space back after the vocabulary learned since detach_special_space.
+    void attach_special_space(const SpecialSpace& space) {
+        special_space = next_id;
+        for (int i = 0; i < space.size; ++i) {
+            append_token("");
+        }
+        next_id += space.size;
+        for (const auto& [offset, token] : space.tokens) {
+            set_special(token, special_space + offset);
+        }
+        specials_changed();
+    }
+
+    void set_special(const std::string& token, int id) {
+        auto existing = special_to_id.find(token);
+        if (existing != special_to_id.end()) {
+            id_to_special.erase(existing->second);
+        }
+        auto previous = id_to_special.find(id);
+        if (previous != id_to_special.end()) {
+            special_to_id.erase(previous->second);
+        }
+        special_to_id[token] = id;
+        id_to_special[id] = token;
+    }
+
+    void specials_changed() {
+        special_matcher = SpecialMatcher(special_to_id);
+        special_ids.assign(next_id, 0);
+        for (const auto& [id, _] : id_to_special) {
+            if (id < next_id) special_ids[id] = 1;
+        }
+    }
+
+    // One past the last non-empty token: byte and merged tokens have text, special tokens and reserved ids do not.
+    int learned_end() const {
+        int end = next_id;
+        while (end > 256 && token(end - 1).empty()) {
+            --end;
+        }
+        return end;
+    }
+
+    void thaw() {
+        for (const Merge& merge : merges()) {
+            pairs[{merge.left, merge.right}] = merge.id;
+        }
+        merge_hash = MergeHash();
+        dense_merges = DenseMergeTable();
+    }
+
+    void append_token(const std::string& bytes) {
+        vocab_bytes.append(bytes.data(), bytes.size());
+        vocab_offsets.push_back(static_cast<uint32_t>(vocab_bytes.size()));
+    }
+
+    int max_vocab_size;
+    PreTokenizer pre_tokenizer;
+    std::unordered_map<std::pair<int, int>, int, pair_hash> pairs;
+    MergeHash merge_hash;
+    DenseMergeTable dense_merges;
+    Table<char> vocab_bytes;
+    Table<uint32_t> vocab_offsets;
+    std::array<int, 256> byte_ids;
+    int next_id;
+    int special_space;
+    std::unordered_map<std::string, int> special_to_id;
+    std::unordered_map<int, std::string> id_to_special;
+    std::vector<char> special_ids;
+    SpecialMatcher special_matcher;
+};
+
+// Double-array trie over the vocabulary: the child of node s for byte c is base[s] + c, valid if its check equals s.
+// The array is padded so that base + 255 is always in range and the walk needs no bounds check. Each node stores the
+// longest token on its path from the root, so a walk just runs until it falls off the trie and emits that token.
+// Every byte has a token, so a longest match is at least one byte long.
+class VocabTrie {
+public:
+    VocabTrie() = default;
+
+    explicit VocabTrie(const BPETokenizer& tokenizer) {
+        std::array<char, 256> bytes;
+        std::vector<std::pair<std::string_view, int>> keys;
+        for (int b = 0; b < 256; ++b) {
+            bytes[b] = static_cast<char>(b);
+            keys.push_back({std::string_view(&bytes[b], 1), tokenizer.byte_table()[b]});
+        }
+        for (int id = 0; id < tokenizer.vocab_size(); ++id) {
+            if (tokenizer.token(id).size() > 1) {
+                keys.push_back({tokenizer.token(id), id});
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end(),
+                               [](const auto& a, const auto& b) { return a.first == b.first; }), keys.end());
+        nodes.assign(256 + 1, Node{0, -1, -1, 0});
+        nodes[0].check = -2;
+        insert(keys, 0, keys.size(), 0, 0, -1);
+        int32_t max_base = 0;
+        for (const Node& node : nodes) {
+            max_base = std::max(max_base, node.base);
+        }
+        nodes.resize(std::max<size_t>(nodes.size(), max_base + 256), Node{0, -1, -1, 0});
+        for (const auto& key : keys) {
+            max_length = std::max(max_length, key.first.size());
+        }
+    }
+
+    // Appends the ids of the longest vocabulary tokens covering text from left to right. `out` is sized for one token
+    // per byte up front and trimmed afterwards. A walk reads at most max_length + 1 bytes, so up to the last
+    // max_length bytes it needs no end check.
+    void encode(std::string_view text, std::vector<int>& out) const {
+        const Node* cells = nodes.data();
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(text.data());
+        size_t n = text.size();
+        size_t start = out.size();
+        out.resize(start + n);
+        int* ids = out.data() + start;
+        size_t pos = 0;
+        size_t unchecked = n > max_length ? n - max_length : 0;
+        while (pos < unchecked) {
+            int32_t state = 0;
+            for (const unsigned char* p = data + pos;; ++p) {
+                int32_t next = cells[state].base + *p;
+                if (cells[next].check != state) break;
+                state = next;
+            }
+            *ids++ = cells[state].id;
+            pos += cells[state].length;
+        }
+        while (pos < n) {
+            int32_t state = 0;
+            for (size_t i = pos; i < n; ++i) {
+                int32_t next = cells[state].base + data[i];
+                if (cells[next].check != state) break;
+                state = next;
+            }
+            *ids++ = cells[state].id;
+            pos += cells[state].length;
+        }
+        out.resize(ids - out.data());
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+private:
+    struct Node {
+        int32_t base;
+        int32_t check;
+        // The longest token that is a prefix of this node's path, and its length.
+        int32_t id;
+        int32_t length;
+    };
+
+    // Places the children of `state`, the node for keys[lo, hi) at `depth`, then recurses into each child. `best` is
+    // the longest token on the path above.
+    void insert(const std::vector<std::pair<std::string_view, int>>& keys, size_t lo, size_t hi, size_t depth,
+                int32_t state, int32_t best) {
+        if (keys[lo].first.size() == depth) {
+            nodes[state].id = keys[lo].second;
+            nodes[state].length = static_cast<int32_t>(depth);
+            ++lo;
+        } else if (best >= 0) {
+            nodes[state].id = nodes[best].id;
+            nodes[state].length = nodes[best].length;
+        }
+        if (nodes[state].length > 0) {
+            best = state;
+        }
+        std::vector<std::pair<unsigned char, size_t>> children;
+        for (size_t i = lo; i < hi; ++i) {
+            unsigned char c = keys[i].first[depth];
+            if (children.empty() || children.back().first != c) {
+                children.push_back({c, i});
+            }
+        }
+        if (children.empty()) return;
+        int32_t base = find_base(children);
+        nodes[state].base = base;
+        for (const auto& child : children) {
+            nodes[base + child.first].check = state;
+        }
+        for (size_t c = 0; c < children.size(); ++c) {
+            size_t end = c + 1 < children.size() ? children[c + 1].second : hi;
+            insert(keys, children[c].second, end, depth + 1, base + children[c].first, best);
+        }
+    }
+
+    // First base at which every child lands on a free cell; the scan starts at the lowest free cell.
+    int32_t find_base(const std::vector<std::pair<unsigned char, size_t>>& children) {
+        while (nodes[first_free].check != -1) {
+            ++first_free;
+        }
+        for (size_t cell = std::max<size_t>(first_free, children[0].first + 1);; ++cell) {
+            if (cell + 256 >= nodes.size()) {
+                nodes.resize(nodes.size() * 2, Node{0, -1, -1, 0});
+            }
+            if (nodes[cell].check != -1) continue;
+            int32_t base = static_cast<int32_t>(cell - children[0].first);
+            bool fits = true;
+            for (const auto& child : children) {
+                if (nodes[base + child.first].check != -1) {
+                    fits = false;
+                    break;
+                }
+            }
+            if (fits) return base;
+        }
+    }
+
+    std::vector<Node> nodes;
+    size_t first_free = 1;
+    size_t max_length = 0;
+};
+
+// bpe applies the learned merges. greedy emits the longest vocabulary token at each position instead, which is faster
+// where tokens are long but not what the model was trained to produce: it ignores the merge order and the
+// pre-tokenizer (special tokens are still matched) and usually yields a somewhat different token count.
+enum class EncodeMode {
+    bpe,
+    greedy,
+};
+
+inline std::string encode_mode_name(EncodeMode mode) {
+    return mode == EncodeMode::greedy ? "greedy" : "bpe";
+}
+
+inline EncodeMode parse_encode_mode(const std::string& name) {
+    if (name == "bpe") return EncodeMode::bpe;
+    if (name == "greedy") return EncodeMode::greedy;
+    throw std::invalid_argument("Unknown encode mode: " + name);
+}
+
+const size_t PARALLEL_ENCODE_MIN_CHUNK = 1 << 20;
+
+// What encode does with special-token text: `all` emits the ids of all special tokens, `none` encodes it as
+// ordinary text without scanning for it, `allowed` emits ids only for the tokens of an allow-list and `raise` throws
+// std::invalid_argument if the input contains any special token.
+enum class SpecialMode {
+    all,
+    none,
+    allowed,
+    raise,
+};
+
+inline SpecialMode parse_special_mode(const std::string& name) {
+    if (name == "all") return SpecialMode::all;
+    if (name == "none") return SpecialMode::none;
+    if (name == "allowed") return SpecialMode::allowed;
+    if (name == "raise") return SpecialMode::raise;
+    throw std::invalid_argument("Unknown special token policy: " + name);
+}
+
+// A special-token mode with its compiled matcher, from FrozenTokenizer::special_policy. The default is `all`.
+class SpecialPolicy {
+public:
+    SpecialPolicy() = default;
+
+    SpecialMode mode() const {
+        return kind;
+    }
+
+private:
+    friend class FrozenTokenizer;
+
+    SpecialPolicy(SpecialMode kind, std::shared_ptr<const SpecialMatcher> matcher)
+        : kind(kind), matcher(std::move(matcher)) {}
+
+    SpecialMode kind = SpecialMode::all;
+    std::shared_ptr<const SpecialMatcher> matcher;
+};
+
+// Immutable tokenizer for sharing between threads. It has no mutating methods, its merges are frozen, its special
+// token matcher is built once, and encode keeps its working buffers in thread-local scratch space, so concurrent
+// encode and decode calls neither write shared state nor take locks. Only special_policy locks, to look up its
+// cache of compiled allow-lists.
+class FrozenTokenizer {
+public:
+    explicit FrozenTokenizer(BPETokenizer tokenizer, EncodeMode mode = EncodeMode::bpe)
+        : model(std::move(tokenizer)), mode(mode) {
+        model.freeze();
+        specials = model.special_token_matcher();
+        if (mode == EncodeMode::greedy) {
+            trie = VocabTrie(model);
+        }
+    }
+
+    static FrozenTokenizer load(const std::string& path, EncodeMode mode = EncodeMode::bpe) {
+        return FrozenTokenizer(BPETokenizer::load(path), mode);
+    }
+
+    // Compiles a special-token policy once; keep it and pass it to encode. The matcher of each allow-list is
+    // cached, so asking again for the same list returns it without rebuilding.
+    SpecialPolicy special_policy(SpecialMode kind, const std::vector<std::string>& allowed = {}) const {
+        if (kind != SpecialMode::allowed) {
+            return SpecialPolicy(kind, nullptr);
+        }
+        std::vector<std::string> key = allowed;
+        std::sort(key.begin(), key.end());
+        key.erase(std::unique(key.begin(), key.end()), key.end());
+        std::lock_guard<std::mutex> lock(policies->mutex);
+        auto& matcher = policies->allowed[key];
+        if (!matcher) {
+            std::unordered_map<std::string, int> subset;
+            for (const std::string& token : key) {
+                int id = model.special_token_id(token);
+                if (id < 0) {
+                    throw std::invalid_argument("Unknown special token " + token);
+                }
+                subset[token] = id;
+            }
+            matcher = std::make_shared<const SpecialMatcher>(subset);
+        }
+        return SpecialPolicy(kind, matcher);
+    }
+
+    std::vector<int> encode(std::string_view input, const SpecialPolicy& policy = SpecialPolicy()) const {
+        std::vector<int> ids;
+        encode(input, ids, policy);
+        return ids;
+    }
+
+    void encode(std::string_view input, std::vector<int>& out, const SpecialPolicy& policy = SpecialPolicy()) const {
+        thread_local EncodeScratch scratch;
+        encode(input, out, scratch, policy);
+    }
+
+    // Does not allocate once scratch and out have grown to fit the largest input.
+    void encode(std::string_view input, std::vector<int>& out, EncodeScratch& scratch,
+                const SpecialPolicy& policy = SpecialPolicy()) const {
+        if (mode == EncodeMode::greedy) {
+            apply_policy(policy, input, out, [&](std::string_view text) { trie.encode(text, out); });
+            return;
+        }
+        apply_policy(policy, input, out, [&](std::string_view text) { model.encode_ordinary(text, out, scratch); });
+    }
+
+    // BPE-dropout encoding; special tokens are never dropped.
+    void encode(std::string_view input, std::vector<int>& out, MergeDropout& dropout,
+                const SpecialPolicy& policy = SpecialPolicy()) const {
+        thread_local EncodeScratch scratch;
+        encode(input, out, scratch, dropout, policy);
+    }
+
+    void encode(std::string_view input, std::vector<int>& out, EncodeScratch& scratch, MergeDropout& dropout,
+                const SpecialPolicy& policy = SpecialPolicy()) const {
+        if (mode == EncodeMode::greedy) {
+            throw std::logic_error("BPE-dropout needs the bpe encode mode");
+        }
+        apply_policy(policy, input, out,
+                     [&](std::string_view text) { model.encode_ordinary(text, out, scratch, dropout); });
+    }
+
+    // Encodes one long input on up to num_threads threads with the same result as encode(). The input is cut where
+    // no merge or special token can cross: at pre-token starts that no special token occurrence straddles, or, with
+    // the `none` pre-tokenizer or greedy mode, at special token starts. Only the special tokens that the policy
+    // splits on count; with SpecialMode::none the `none` pre-tokenizer has no cuts. The chunks are encoded
+    // independently and copied into place at offsets given by a prefix sum of their lengths.
+    void encode_parallel(std::string_view input, std::vector<int>& out, int num_threads,
+                         const SpecialPolicy& policy = SpecialPolicy()) const {
+        std::vector<size_t> cuts = parallel_cuts(input, num_threads, policy);
+        size_t chunks = cuts.size() - 1;
+        if (chunks <= 1) {
+            encode(input, out, policy);
+            return;
+        }
+        std::vector<std::vector<int>> parts(chunks);
+        auto run = [&](auto&& work) {
+            std::vector<std::thread> threads;
+            for (size_t c = 1; c < chunks; ++c) {
+                threads.emplace_back(work, c);
+            }
+            work(0);
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        };
+        // SpecialMode::raise throws from whichever chunk holds the token; the first failure is rethrown after join.
+        std::vector<std::exception_ptr> failures(chunks);
+        run([&](size_t c) {
+            TraceSpan span("encode_chunk", "encode");
+            span.arg("offset", cuts[c]);
+            try {
+                encode(input.substr(cuts[c], cuts[c + 1] - cuts[c]), parts[c], policy);
+            } catch (...) {
+                failures[c] = std::current_exception();
+            }
+        });
+        for (const auto& failure : failures) {
+            if (failure) std::rethrow_exception(failure);
+        }
+        std::vector<size_t> offsets(chunks + 1, out.size());
+        for (size_t c = 0; c < chunks; ++c) {
+            offsets[c + 1] = offsets[c] + parts[c].size();
+        }
+        out.resize(offsets[chunks]);
+        run([&](size_t c) { std::copy(parts[c].begin(), parts[c].end(), out.begin() + offsets[c]); });
+    }
+
+    // The first position at or after pos where input can be cut so that encoding the two sides separately gives the
+    // ids of one encode under `policy`, or input.size() if there is none. With `more`, input is the start of a longer
+    // text and only cuts that hold whatever follows are returned, which lets a stream be encoded block by block.
+    size_t next_split(std::string_view input, size_t pos, const SpecialPolicy& policy = SpecialPolicy(),
+                      bool more = false) const {
+        size_t limit = input.size();
+        if (more) {
+            // Deciding a cut reads at most one special token's length past it (one byte past it for next_safe_split).
+            size_t lookahead = std::max<size_t>(specials.max_token_length(), 1);
+            limit = input.size() > lookahead ? input.size() - lookahead : 0;
+        }
+        size_t cut = next_cut(input, std::max<size_t>(pos, 1), split_matcher(policy));
+        return cut < limit ? cut : input.size();
+    }
+
+    std::string decode(const std::vector<int>& ids) const {
+        return model.decode(ids);
+    }
+
+    int vocab_size() const {
+        return model.vocab_size();
+    }
+
+    std::string_view token(int id) const {
+        return model.token(id);
+    }
+
+    int special_token_id(const std::string& token) const {
+        return model.special_token_id(token);
+    }
+
+    const BPETokenizer& tokenizer() const {
+        return model;
+    }
+
+    EncodeMode encode_mode() const {
+        return mode;
+    }
+
+private:
+    // The special tokens that encode splits the input at under `policy`: none for SpecialMode::none. `raise` counts
+    // all of them, so that a chunk boundary never hides an occurrence from the check.
+    const SpecialMatcher* split_matcher(const SpecialPolicy& policy) const {
+        switch (policy.kind) {
+        case SpecialMode::none: return nullptr;
+        case SpecialMode::allowed: return policy.matcher.get();
+        default: return &specials;
+        }
+    }
+
+    size_t next_cut(std::string_view input, size_t pos, const SpecialMatcher* matcher) const {
+        if (model.pre_tokenizer_mode() == PreTokenizer::none || mode == EncodeMode::greedy) {
+            size_t start, length;
+            int id;
+            while (matcher && matcher->find(input, pos, start, length, id)) {
+                if (!matcher->straddles(input, start)) return start;
+                pos = start + 1;
+            }
+            return input.size();
+        }
+        for (size_t cut = next_safe_split(input, pos); cut < input.size(); cut = next_safe_split(input, cut + 1)) {
+            if (!matcher || !matcher->straddles(input, cut)) return cut;
+        }
+        return input.size();
+    }
+
+    std::vector<size_t> parallel_cuts(std::string_view input, int num_threads, const SpecialPolicy& policy) const {
+        const SpecialMatcher* matcher = split_matcher(policy);
+        size_t target = std::max(input.size() / std::max(1, num_threads), PARALLEL_ENCODE_MIN_CHUNK);
+        std::vector<size_t> cuts = {0};
+        for (size_t pos = target; pos < input.size(); pos = cuts.back() + target) {
+            size_t cut = next_cut(input, pos, matcher);
+            if (cut >= input.size()) break;
+            cuts.push_back(cut);
+        }
+        cuts.push_back(input.size());
+        return cuts;
+    }
+
+    template <class EncodeOrdinary>
+    void apply_policy(const SpecialPolicy& policy, std::string_view input, std::vector<int>& out,
+                      EncodeOrdinary encode_ordinary) const {
+        switch (policy.kind) {
+        case SpecialMode::none:
+            encode_ordinary(input);
+            return;
+        case SpecialMode::allowed:
+            split_specials(input, out, encode_ordinary, *policy.matcher);
+            return;
+        case SpecialMode::raise: {
+            size_t start, length;
+            int id;
+            if (specials.find(input, 0, start, length, id)) {
+                throw std::invalid_argument("Input contains special token " + std::string(input.substr(start, length)));
+            }
+            encode_ordinary(input);
+            return;
+        }
+        default:
+            split_specials(input, out, encode_ordinary, specials);
+        }
+    }
+
+    template <class EncodeOrdinary>
+    void split_specials(std::string_view input, std::vector<int>& out, EncodeOrdinary encode_ordinary,
+                        const SpecialMatcher& matcher) const {
+        BPE_PHASE(PHASE_SPECIAL_SPLIT);
+        size_t pos = 0, start, length;
+        int id;
+        while (matcher.find(input, pos, start, length, id)) {
+            encode_ordinary(input.substr(pos, start - pos));
+            BPE_COUNT(COUNTER_BYTES_IN, length);
+            BPE_COUNT(COUNTER_TOKENS_OUT, 1);
+            out.push_back(id);
+            pos = start + length;
+        }
+        encode_ordinary(input.substr(pos));
+    }
+
+    struct PolicyCache {
+        std::mutex mutex;
+        std::map<std::vector<std::string>, std::shared_ptr<const SpecialMatcher>> allowed;
+    };
+
+    BPETokenizer model;
+    EncodeMode mode;
+    SpecialMatcher specials;
+    // Shared by copies, which have the same special tokens.
+    std::shared_ptr<PolicyCache> policies = std::make_shared<PolicyCache>();
+    VocabTrie trie;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "bpe.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <type_traits>
+
+inline bool is_identifier(const std::string& name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(),
+                       [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; });
+}
+
+inline void write_string_literal(std::ostream& out, std::string_view bytes, const char* indent) {
+    const size_t BYTES_PER_LINE = 64;
+    if (bytes.empty()) {
+        out << "\"\"";
+        return;
+    }
+    char escape[8];
+    for (size_t start = 0; start < bytes.size(); start += BYTES_PER_LINE) {
+        if (start > 0) {
+            out << "\n" << indent;
+        }
+        out << '"';
+        for (unsigned char c : bytes.substr(start, BYTES_PER_LINE)) {
+            if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') {
+                out << static_cast<char>(c);
+            } else {
+                std::snprintf(escape, sizeof(escape), "\\%03o", c);
+                out << escape;
+            }
+        }
+        out << '"';
+    }
+}
+
+template <class T>
+void write_array(std::ostream& out, const char* type, const std::string& name, const T* values, size_t size) {
+    const size_t VALUES_PER_LINE = 16;
+    out << "inline constexpr " << type << " " << name << "[] = {";
+    if (size == 0) {
+        out << "0";
+    }
+    for (size_t i = 0; i < size; ++i) {
+        out << (i % VALUES_PER_LINE == 0 ? "\n    " : " ") << +values[i];
+        if (std::is_same<T, uint64_t>::value) out << "ULL";
+        if (i + 1 < size) out << ",";
+    }
+    out << "\n};\n\n";
+}
+
+// Writes a C++ header with the tokenizer's tables as constexpr arrays, the merges in a MergeHash image, and
+// `<name>_tokenizer()` which wraps them in a BPETokenizer without copying.
+inline void write_embedded_header(const BPETokenizer& tokenizer, std::ostream& out, const std::string& name) {
+    if (!is_identifier(name)) {
+        throw std::invalid_argument("Embedded model name " + name + " is not a C++ identifier");
+    }
+    int vocab_size = tokenizer.vocab_size();
+    std::vector<uint32_t> offsets(vocab_size + 1, 0);
+    std::string bytes;
+    for (int id = 0; id < vocab_size; ++id) {
+        bytes += tokenizer.token(id);
+        offsets[id + 1] = static_cast<uint32_t>(bytes.size());
+    }
+    MergeHash hash = MergeHash::build(tokenizer.merges());
+    std::vector<std::pair<std::string, int>> specials(tokenizer.special_tokens().begin(),
+                                                      tokenizer.special_tokens().end());
+    std::sort(specials.begin(), specials.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+
+    out << "// Generated by `bpe embed`. Do not edit.\n"
+        << "#pragma once\n\n"
+        << "#include \"bpe.hpp\"\n\n";
+    out << "inline constexpr char " << name << "_vocab_bytes[] =\n    ";
+    write_string_literal(out, bytes, "    ");
+    out << ";\n\n";
+    write_array(out, "uint32_t", name + "_vocab_offsets", offsets.data(), offsets.size());
+    write_array(out, "int", name + "_byte_ids", tokenizer.byte_table().data(), 256);
+    write_array(out, "uint32_t", name + "_merge_seeds", hash.seed_table().data(), hash.seed_table().size());
+    write_array(out, "uint64_t", name + "_merge_keys", hash.key_table().data(), hash.key_table().size());
+    write_array(out, "int32_t", name + "_merge_ids", hash.id_table().data(), hash.id_table().size());
+
+    out << "inline constexpr EmbeddedSpecial " << name << "_specials[] = {";
+    if (specials.empty()) {
+        out << "{\"\", 0, -1}";
+    }
+    for (size_t i = 0; i < specials.size(); ++i) {
+        out << "\n    {";
+        write_string_literal(out, specials[i].first, "     ");
+        out << ", " << specials[i].first.size() << ", " << specials[i].second << "}";
+        if (i + 1 < specials.size()) out << ",";
+    }
+    out << "\n};\n\n";
+
+    out << "inline constexpr EmbeddedModel " << name << "_model = {\n"
+        << "    PreTokenizer::" << pre_tokenizer_name(tokenizer.pre_tokenizer_mode()) << ",\n"
+        << "    " << std::max(tokenizer.max_vocab(), 257) << ",\n"
+        << "    " << vocab_size << ",\n"
+        << "    " << name << "_vocab_bytes,\n"
+        << "    " << name << "_vocab_offsets,\n"
+        << "    " << name << "_byte_ids,\n"
+        << "    " << name << "_merge_seeds,\n"
+        << "    " << hash.seed_table().size() << ",\n"
+        << "    " << name << "_merge_keys,\n"
+        << "    " << name << "_merge_ids,\n"
+        << "    " << hash.size() << ",\n"
+        << "    " << name << "_specials,\n"
+        << "    " << specials.size() << ",\n"
+        << "    " << tokenizer.special_space_start() << ",\n"
+        << "};\n\n";
+
+    out << "inline BPETokenizer " << name << "_tokenizer() {\n"
+        << "    return BPETokenizer(" << name << "_model);\n"
+        << "}\n";
+}
@@ -0,0 +1,476 @@
+#pragma once
+
+#include "bpe.hpp"
+#include "json.hpp"
+
+#include <optional>
+#include <tuple>
+
+inline std::string read_vocab_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        throw std::runtime_error("Error opening " + path);
+    }
+    std::string data(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    if (!file.read(&data[0], data.size())) {
+        throw std::runtime_error("Error reading " + path);
+    }
+    return data;
+}
+
+// GPT-2 maps every byte to a printable code point so that vocab.json and merges.txt stay whitespace free.
+inline std::array<uint32_t, 256> gpt2_byte_to_unicode() {
+    std::array<uint32_t, 256> table{};
+    uint32_t extra = 0;
+    for (uint32_t b = 0; b < 256; ++b) {
+        bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+        table[b] = printable ? b : 256 + extra++;
+    }
+    return table;
+}
+
+class ByteLevelDecoder {
+public:
+    ByteLevelDecoder() : unicode_to_byte(324, -1) {
+        std::array<uint32_t, 256> table = gpt2_byte_to_unicode();
+        for (int b = 0; b < 256; ++b) {
+            unicode_to_byte[table[b]] = b;
+        }
+    }
+
+    bool decode(std::string_view text, std::string& out) const {
+        size_t start = out.size();
+        size_t i = 0;
+        while (i < text.size()) {
+            unsigned char c = text[i];
+            uint32_t cp = unicode_to_byte.size();
+            if (c < 0x80) {
+                cp = c;
+                i += 1;
+            } else if ((c & 0xE0) == 0xC0 && i + 1 < text.size()) {
+                cp = ((c & 0x1F) << 6) | (text[i + 1] & 0x3F);
+                i += 2;
+            }
+            if (cp >= unicode_to_byte.size() || unicode_to_byte[cp] < 0) {
+                out.resize(start);
+                return false;
+            }
+            out += static_cast<char>(unicode_to_byte[cp]);
+        }
+        return true;
+    }
+
+private:
+    std::vector<int> unicode_to_byte;
+};
+
+class ImportedVocab {
+public:
+    std::string& scratch_buffer() {
+        return scratch;
+    }
+
+    void add_scratch_tail(int id, size_t start) {
+        if (id < 0) {
+            throw std::runtime_error("Negative token ID in vocabulary");
+        }
+        entries.emplace_back(id, static_cast<uint32_t>(start), static_cast<uint32_t>(scratch.size() - start));
+    }
+
+    void build() {
+        std::sort(entries.begin(), entries.end());
+        int vocab_size = entries.empty() ? 0 : std::get<0>(entries.back()) + 1;
+        bytes.reserve(scratch.size());
+        offsets.assign(1, 0);
+        size_t e = 0;
+        for (int id = 0; id < vocab_size; ++id) {
+            if (e < entries.size() && std::get<0>(entries[e]) == id) {
+                auto first = scratch.begin() + std::get<1>(entries[e]);
+                bytes.insert(bytes.end(), first, first + std::get<2>(entries[e]));
+                while (e < entries.size() && std::get<0>(entries[e]) == id) e++;
+            }
+            offsets.push_back(static_cast<uint32_t>(bytes.size()));
+        }
+        std::string().swap(scratch);
+        std::vector<std::tuple<int, uint32_t, uint32_t>>().swap(entries);
+
+        size_t capacity = 16;
+        while (capacity < 2 * static_cast<size_t>(vocab_size)) {
+            capacity *= 2;
+        }
+        index.assign(capacity, -1);
+        for (int id = 0; id < vocab_size; ++id) {
+            if (offsets[id + 1] > offsets[id]) {
+                size_t slot = probe(token(id));
+                if (index[slot] < 0) index[slot] = id;
+            }
+        }
+    }
+
+    int size() const {
+        return static_cast<int>(offsets.size()) - 1;
+    }
+
+    std::string_view token(int id) const {
+        return std::string_view(bytes.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    int find(std::string_view bytes) const {
+        return index.empty() ? -1 : index[probe(bytes)];
+    }
+
+    std::array<int, 256> byte_ids() const {
+        std::array<int, 256> result;
+        for (int b = 0; b < 256; ++b) {
+            char c = static_cast<char>(b);
+            result[b] = find(std::string_view(&c, 1));
+            if (result[b] < 0) {
+                throw std::runtime_error("Vocabulary has no token for byte " + std::to_string(b));
+            }
+        }
+        return result;
+    }
+
+    // Empties a token's text. Its index slot stays occupied, so lookups of other tokens still probe past it.
+    void drop(int id) {
+        uint32_t length = offsets[id + 1] - offsets[id];
+        bytes.erase(bytes.begin() + offsets[id], bytes.begin() + offsets[id + 1]);
+        for (size_t i = id + 1; i < offsets.size(); ++i) {
+            offsets[i] -= length;
+        }
+    }
+
+    BPETokenizer into_tokenizer(PreTokenizer pre_tokenizer, const std::vector<Merge>& merges) {
+        std::array<int, 256> bytes_to_ids = byte_ids();
+        std::vector<int32_t>().swap(index);
+        return BPETokenizer::from_tables(pre_tokenizer, std::move(bytes), std::move(offsets), bytes_to_ids, merges);
+    }
+
+private:
+    // The slot holding the id of `bytes`, or the empty slot where it would go.
+    size_t probe(std::string_view bytes) const {
+        size_t mask = index.size() - 1;
+        size_t slot = std::hash<std::string_view>{}(bytes) & mask;
+        while (index[slot] >= 0 && token(index[slot]) != bytes) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    std::string scratch;
+    std::vector<std::tuple<int, uint32_t, uint32_t>> entries;
+    std::vector<char> bytes;
+    std::vector<uint32_t> offsets;
+    // Open addressing over the arena with linear probing, at most half full; -1 marks an empty slot.
+    std::vector<int32_t> index;
+};
+
+// Byte-level merges decoded into one buffer. The two halves of a merge are stored next to each other, so the merged
+// token is the span of both and nothing is allocated per merge.
+class DecodedMerges {
+public:
+    void add(std::string_view left, std::string_view right, const ByteLevelDecoder& decoder) {
+        size_t start = bytes.size();
+        if (!decoder.decode(left, bytes)) {
+            throw std::runtime_error("Merge \"" + std::string(left) + " " + std::string(right) +
+                                     "\" is not byte-level encoded");
+        }
+        size_t split = bytes.size();
+        if (!decoder.decode(right, bytes)) {
+            bytes.resize(start);
+            throw std::runtime_error("Merge \"" + std::string(left) + " " + std::string(right) +
+                                     "\" is not byte-level encoded");
+        }
+        spans.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(split - start),
+                         static_cast<uint32_t>(bytes.size() - start)});
+    }
+
+    size_t size() const {
+        return spans.size();
+    }
+
+    std::string_view left(size_t i) const {
+        return std::string_view(bytes).substr(spans[i].start, spans[i].left);
+    }
+
+    std::string_view right(size_t i) const {
+        return std::string_view(bytes).substr(spans[i].start + spans[i].left, spans[i].length - spans[i].left);
+    }
+
+    std::string_view merged(size_t i) const {
+        return std::string_view(bytes).substr(spans[i].start, spans[i].length);
+    }
+
+private:
+    struct Span {
+        uint32_t start;
+        uint32_t left;
+        uint32_t length;
+    };
+
+    std::string bytes;
+    std::vector<Span> spans;
+};
+
+inline void check_rank_order(const std::vector<Merge>& merges) {
+    for (size_t i = 1; i < merges.size(); ++i) {
+        if (merges[i].id < merges[i - 1].id) {
+            throw std::runtime_error("Merge ranks do not follow token ID order, which is not supported");
+        }
+    }
+}
+
+inline int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+inline void base64_decode(std::string_view text, std::string& out) {
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : text) {
+        if (c == '=') break;
+        int value = base64_value(c);
+        if (value < 0) {
+            throw std::runtime_error("Invalid base64 in tiktoken file");
+        }
+        buffer = (buffer << 6) | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>((buffer >> bits) & 0xFF);
+        }
+    }
+}
+
+// tiktoken files list "<base64 token> <rank>" per line; the rank is the token ID. Merges are recovered by
+// splitting every token into two lower-ranked tokens, which reproduces tiktoken's rank-based merging.
+inline BPETokenizer load_tiktoken(const std::string& path, PreTokenizer pre_tokenizer = PreTokenizer::cl100k) {
+    std::string text = read_vocab_file(path);
+    ImportedVocab vocab;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string_view line(text.data() + pos, end - pos);
+        pos = end + 1;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty()) continue;
+
+        size_t space = line.find(' ');
+        if (space == std::string_view::npos) {
+            throw std::runtime_error("Malformed tiktoken line in " + path);
+        }
+        int rank = 0;
+        for (char c : line.substr(space + 1)) {
+            if (c < '0' || c > '9') {
+                throw std::runtime_error("Malformed tiktoken rank in " + path);
+            }
+            rank = rank * 10 + (c - '0');
+        }
+        size_t start = vocab.scratch_buffer().size();
+        base64_decode(line.substr(0, space), vocab.scratch_buffer());
+        vocab.add_scratch_tail(rank, start);
+    }
+    vocab.build();
+
+    std::vector<Merge> merges;
+    for (int id = 0; id < vocab.size(); ++id) {
+        std::string_view token = vocab.token(id);
+        for (size_t split = 1; split < token.size(); ++split) {
+            int left = vocab.find(token.substr(0, split));
+            int right = vocab.find(token.substr(split));
+            if (left >= 0 && right >= 0 && left < id && right < id) {
+                merges.push_back({left, right, id});
+            }
+        }
+    }
+    return vocab.into_tokenizer(pre_tokenizer, merges);
+}
+
+inline std::vector<Merge> parse_byte_level_merges(const DecodedMerges& decoded, const ImportedVocab& vocab) {
+    std::vector<Merge> merges;
+    merges.reserve(decoded.size());
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        Merge merge{vocab.find(decoded.left(i)), vocab.find(decoded.right(i)), vocab.find(decoded.merged(i))};
+        if (merge.left < 0 || merge.right < 0 || merge.id < 0) {
+            throw std::runtime_error("Merge " + std::to_string(i + 1) + " references a token missing from the vocab");
+        }
+        merges.push_back(merge);
+    }
+    check_rank_order(merges);
+    return merges;
+}
+
+// A special token that is also a vocabulary entry keeps its id but loses its text, so that plain text is never
+// encoded to it (greedy matching would otherwise find it under any special-token policy). Tokens used by a merge
+// are ordinary vocabulary and keep their text.
+inline void drop_special_texts(ImportedVocab& vocab, const std::vector<Merge>& merges,
+                               const std::vector<std::pair<std::string, int>>& specials) {
+    std::vector<bool> merged(vocab.size(), false);
+    for (const Merge& merge : merges) {
+        merged[merge.left] = merged[merge.right] = merged[merge.id] = true;
+    }
+    for (const auto& [content, id] : specials) {
+        if (id >= 0 && id < vocab.size() && !merged[id] && vocab.token(id) == content) {
+            vocab.drop(id);
+        }
+    }
+}
+
+inline void parse_byte_level_vocab(JsonReader& reader, ImportedVocab& vocab, const ByteLevelDecoder& decoder) {
+    std::string key;
+    reader.expect('{');
+    while (reader.next_member(key)) {
+        size_t start = vocab.scratch_buffer().size();
+        if (!decoder.decode(key, vocab.scratch_buffer())) {
+            vocab.scratch_buffer() += key;
+        }
+        vocab.add_scratch_tail(static_cast<int>(reader.read_int()), start);
+    }
+}
+
+inline BPETokenizer load_gpt2(const std::string& encoder_path, const std::string& merges_path,
+                              PreTokenizer pre_tokenizer = PreTokenizer::gpt2) {
+    ByteLevelDecoder decoder;
+    ImportedVocab vocab;
+    std::string encoder = read_vocab_file(encoder_path);
+    JsonReader reader(encoder);
+    parse_byte_level_vocab(reader, vocab, decoder);
+    vocab.build();
+    int end_of_text = vocab.find("<|endoftext|>");
+
+    std::string text = read_vocab_file(merges_path);
+    DecodedMerges merges;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string_view line(text.data() + pos, end - pos);
+        pos = end + 1;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty() || line[0] == '#') continue;
+
+        size_t space = line.find(' ');
+        if (space == std::string_view::npos) {
+            throw std::runtime_error("Malformed merge line in " + merges_path);
+        }
+        merges.add(line.substr(0, space), line.substr(space + 1), decoder);
+    }
+
+    std::vector<Merge> merge_list = parse_byte_level_merges(merges, vocab);
+    drop_special_texts(vocab, merge_list, {{"<|endoftext|>", end_of_text}});
+    BPETokenizer tokenizer = vocab.into_tokenizer(pre_tokenizer, merge_list);
+    if (end_of_text >= 0) {
+        tokenizer.add_special_token("<|endoftext|>", end_of_text);
+    }
+    return tokenizer;
+}
+
+// The pre-tokenizer is detected from the file unless one is given.
+inline BPETokenizer load_hf_tokenizer(const std::string& path, std::optional<PreTokenizer> pre_tokenizer = {}) {
+    std::string text = read_vocab_file(path);
+    ByteLevelDecoder decoder;
+    ImportedVocab vocab;
+    DecodedMerges merges;
+    std::vector<std::pair<std::string, int>> added_tokens;
+    std::string_view pre_tokenizer_json, decoder_json;
+    std::string model_type = "BPE";
+
+    JsonReader reader(text);
+    std::string key, field, value, left, right;
+    reader.expect('{');
+    while (reader.next_member(key)) {
+        if (key == "model") {
+            reader.expect('{');
+            while (reader.next_member(field)) {
+                if (field == "type") {
+                    reader.read_string(model_type);
+                } else if (field == "vocab") {
+                    parse_byte_level_vocab(reader, vocab, decoder);
+                } else if (field == "merges") {
+                    reader.expect('[');
+                    while (reader.next_element()) {
+                        if (reader.peek() == '[') {
+                            reader.expect('[');
+                            reader.read_string(left);
+                            reader.expect(',');
+                            reader.read_string(right);
+                            reader.expect(']');
+                            merges.add(left, right, decoder);
+                        } else {
+                            reader.read_string(value);
+                            size_t space = value.find(' ');
+                            if (space == std::string::npos) {
+                                reader.fail("malformed merge \"" + value + "\"");
+                            }
+                            std::string_view merge(value);
+                            merges.add(merge.substr(0, space), merge.substr(space + 1), decoder);
+                        }
+                    }
+                } else {
+                    reader.skip_value();
+                }
+            }
+        } else if (key == "added_tokens" && reader.peek() == '[') {
+            reader.expect('[');
+            while (reader.next_element()) {
+                std::string content;
+                int id = -1;
+                bool special = true;
+                reader.expect('{');
+                while (reader.next_member(field)) {
+                    if (field == "id") {
+                        id = static_cast<int>(reader.read_int());
+                    } else if (field == "content") {
+                        reader.read_string(content);
+                    } else if (field == "special") {
+                        special = reader.read_bool();
+                    } else {
+                        reader.skip_value();
+                    }
+                }
+                // Added tokens with "special": false are ordinary vocabulary, not control tokens.
+                if (special) {
+                    added_tokens.emplace_back(std::move(content), id);
+                }
+            }
+        } else if (key == "pre_tokenizer") {
+            pre_tokenizer_json = reader.raw_value();
+        } else if (key == "decoder") {
+            decoder_json = reader.raw_value();
+        } else {
+            reader.skip_value();
+        }
+    }
+
+    if (model_type != "BPE") {
+        throw std::runtime_error(path + ": model type " + model_type + " is not BPE");
+    }
+    if (pre_tokenizer_json.find("ByteLevel") == std::string_view::npos &&
+        decoder_json.find("ByteLevel") == std::string_view::npos) {
+        throw std::runtime_error(path + ": only byte-level BPE tokenizers are supported");
+    }
+    PreTokenizer mode = PreTokenizer::none;
+    if (pre_tokenizer_json.find("p{N}{1,3}") != std::string_view::npos) {
+        mode = PreTokenizer::cl100k;
+    } else if (pre_tokenizer_json.find("ByteLevel") != std::string_view::npos) {
+        mode = PreTokenizer::gpt2;
+    }
+
+    vocab.build();
+    std::vector<Merge> merge_list = parse_byte_level_merges(merges, vocab);
+    drop_special_texts(vocab, merge_list, added_tokens);
+    BPETokenizer tokenizer = vocab.into_tokenizer(pre_tokenizer.value_or(mode), merge_list);
+    for (const auto& [content, id] : added_tokens) {
+        if (id >= 0 && !content.empty()) {
+            tokenizer.add_special_token(content, id);
+        }
+    }
+    return tokenizer;
+}
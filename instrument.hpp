@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Hot-path counters and phase timers, compiled in with -DBPE_INSTRUMENT=1. Without it the BPE_* macros expand to
+// nothing and snapshots are empty. Each thread counts into its own slot (relaxed load/store, no locked instructions);
+// snapshot() sums the live slots and those of exited threads.
+#ifndef BPE_INSTRUMENT
+#define BPE_INSTRUMENT 0
+#endif
+
+enum InstrumentCounter {
+    COUNTER_HEAP_PUSHES,
+    COUNTER_HEAP_POPS,
+    COUNTER_HASH_PROBES,
+    COUNTER_DENSE_HITS,
+    COUNTER_ARENA_ALLOCATIONS,
+    COUNTER_BYTES_IN,
+    COUNTER_TOKENS_OUT,
+    COUNTER_PAIR_UPDATES,
+    NUM_COUNTERS,
+};
+
+// Phase times are exclusive: a phase nested in another is not counted twice.
+enum InstrumentPhase {
+    PHASE_PRE_TOKENIZE,
+    PHASE_SPECIAL_SPLIT,
+    PHASE_MERGE,
+    PHASE_OUTPUT,
+    PHASE_TRAIN_COUNT,
+    PHASE_TRAIN_INIT,
+    PHASE_TRAIN_MERGE,
+    NUM_PHASES,
+};
+
+inline const char* counter_name(int counter) {
+    static const char* const names[NUM_COUNTERS] = {
+        "heap_pushes", "heap_pops", "hash_probes", "dense_hits", "arena_allocations", "bytes_in", "tokens_out",
+        "pair_updates",
+    };
+    return names[counter];
+}
+
+inline const char* phase_name(int phase) {
+    static const char* const names[NUM_PHASES] = {
+        "pre_tokenize", "special_split", "merge", "output", "train_count", "train_init", "train_merge",
+    };
+    return names[phase];
+}
+
+struct MergeTiming {
+    int id;
+    int64_t count;
+    uint64_t ns;
+};
+
+struct InstrumentStats {
+    std::array<uint64_t, NUM_COUNTERS> counters{};
+    std::array<uint64_t, NUM_PHASES> phase_ns{};
+    std::vector<MergeTiming> merges;
+};
+
+inline uint64_t instrument_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Instrumentation {
+public:
+    struct Slot {
+        std::array<std::atomic<uint64_t>, NUM_COUNTERS> counters{};
+        std::array<std::atomic<uint64_t>, NUM_PHASES> phase_ns{};
+        uint64_t nested_ns = 0;
+    };
+
+    static constexpr bool enabled() {
+        return BPE_INSTRUMENT != 0;
+    }
+
+    static Instrumentation& instance() {
+        static Instrumentation instrumentation;
+        return instrumentation;
+    }
+
+    static Slot& thread_slot() {
+        thread_local Registration registration;
+        return registration.slot;
+    }
+
+    static void add(std::atomic<uint64_t>& value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void record_merge(const MergeTiming& timing) {
+        std::lock_guard<std::mutex> lock(mutex);
+        merges.push_back(timing);
+    }
+
+    InstrumentStats snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        InstrumentStats stats = retired;
+        for (const Slot* slot : slots) {
+            accumulate(*slot, stats);
+        }
+        stats.merges = merges;
+        return stats;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        retired = InstrumentStats();
+        merges.clear();
+        for (Slot* slot : slots) {
+            for (auto& value : slot->counters) value.store(0, std::memory_order_relaxed);
+            for (auto& value : slot->phase_ns) value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Registration {
+        Registration() {
+            Instrumentation& instrumentation = instance();
+            std::lock_guard<std::mutex> lock(instrumentation.mutex);
+            instrumentation.slots.push_back(&slot);
+        }
+
+        ~Registration() {
+            Instrumentation& instrumentation = instance();
+            std::lock_guard<std::mutex> lock(instrumentation.mutex);
+            accumulate(slot, instrumentation.retired);
+            auto& slots = instrumentation.slots;
+            slots.erase(std::find(slots.begin(), slots.end(), &slot));
+        }
+
+        Slot slot;
+    };
+
+    static void accumulate(const Slot& slot, InstrumentStats& stats) {
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            stats.counters[i] += slot.counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < NUM_PHASES; ++i) {
+            stats.phase_ns[i] += slot.phase_ns[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    std::mutex mutex;
+    std::vector<Slot*> slots;
+    InstrumentStats retired;
+    std::vector<MergeTiming> merges;
+};
+
+// Charges the time since construction (or the last next()) to the current phase, minus time spent in timers
+// nested inside it; the total is charged to the enclosing timer as nested time.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(InstrumentPhase phase) : slot(Instrumentation::thread_slot()), phase(phase) {
+        start = last = instrument_now_ns();
+        outer_nested = slot.nested_ns;
+        slot.nested_ns = 0;
+    }
+
+    ~PhaseTimer() {
+        uint64_t now = instrument_now_ns();
+        charge(now);
+        slot.nested_ns = outer_nested + (now - start);
+    }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    void next(InstrumentPhase next_phase) {
+        charge(instrument_now_ns());
+        phase = next_phase;
+    }
+
+private:
+    void charge(uint64_t now) {
+        uint64_t elapsed = now - last;
+        Instrumentation::add(slot.phase_ns[phase], elapsed > slot.nested_ns ? elapsed - slot.nested_ns : 0);
+        slot.nested_ns = 0;
+        last = now;
+    }
+
+    Instrumentation::Slot& slot;
+    InstrumentPhase phase;
+    uint64_t start;
+    uint64_t last;
+    uint64_t outer_nested;
+};
+
+#if BPE_INSTRUMENT
+#define BPE_COUNT(counter, n) Instrumentation::add(Instrumentation::thread_slot().counters[counter], (n))
+#define BPE_PHASE_CONCAT(a, b) a##b
+#define BPE_PHASE_NAME(line) BPE_PHASE_CONCAT(bpe_phase_timer_, line)
+#define BPE_PHASE(phase) PhaseTimer BPE_PHASE_NAME(__LINE__)(phase)
+#define BPE_NAMED_PHASE(name, phase) PhaseTimer name(phase)
+#define BPE_NEXT_PHASE(name, phase) name.next(phase)
+#define BPE_INSTRUMENTED(...) __VA_ARGS__
+#else
+#define BPE_COUNT(counter, n) ((void)0)
+#define BPE_PHASE(phase) ((void)0)
+#define BPE_NAMED_PHASE(name, phase) ((void)0)
+#define BPE_NEXT_PHASE(name, phase) ((void)0)
+#define BPE_INSTRUMENTED(...)
+#endif
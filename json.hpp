@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+class JsonReader {
+public:
+    JsonReader(const char* data, size_t size) : p(data), end(data + size) {}
+
+    explicit JsonReader(const std::string& text) : JsonReader(text.data(), text.size()) {}
+
+    char peek() {
+        skip_ws();
+        return p < end ? *p : '\0';
+    }
+
+    bool at_end() {
+        skip_ws();
+        return p >= end;
+    }
+
+    bool consume(char c) {
+        if (peek() == c) {
+            p++;
+            opened = c == '{' || c == '[';
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c)) {
+            fail(std::string("expected '") + c + "'");
+        }
+    }
+
+    bool next_member(std::string& key) {
+        return next_item('}') && (read_string(key), expect(':'), true);
+    }
+
+    bool next_element() {
+        return next_item(']');
+    }
+
+    void read_string(std::string& out) {
+        out.clear();
+        expect('"');
+        while (true) {
+            const char* start = p;
+            while (p < end && *p != '"' && *p != '\\') {
+                p++;
+            }
+            out.append(start, p - start);
+            if (p >= end) {
+                fail("unterminated string");
+            }
+            if (*p++ == '"') {
+                return;
+            }
+            if (p >= end) {
+                fail("unterminated escape");
+            }
+            char c = *p++;
+            switch (c) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': append_utf8(out, read_codepoint()); break;
+                default: fail("invalid escape");
+            }
+        }
+    }
+
+    std::string read_string() {
+        std::string out;
+        read_string(out);
+        return out;
+    }
+
+    int64_t read_int() {
+        skip_ws();
+        bool negative = p < end && *p == '-';
+        if (negative) {
+            p++;
+        }
+        if (p >= end || *p < '0' || *p > '9') {
+            fail("expected integer");
+        }
+        int64_t value = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            value = value * 10 + (*p++ - '0');
+        }
+        return negative ? -value : value;
+    }
+
+    bool read_bool() {
+        std::string_view value = raw_value();
+        if (value != "true" && value != "false") {
+            fail("expected boolean");
+        }
+        return value == "true";
+    }
+
+    void skip_value() {
+        char c = peek();
+        if (c == '"') {
+            skip_string();
+        } else if (c == '{') {
+            consume('{');
+            while (next_item('}')) {
+                skip_string();
+                expect(':');
+                skip_value();
+            }
+        } else if (c == '[') {
+            consume('[');
+            while (next_item(']')) {
+                skip_value();
+            }
+        } else {
+            const char* start = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ']' && !is_ws(*p)) {
+                p++;
+            }
+            if (p == start) {
+                fail(p < end ? std::string("unexpected '") + *p + "'" : "unexpected end of input");
+            }
+        }
+    }
+
+    std::string_view raw_value() {
+        skip_ws();
+        const char* start = p;
+        skip_value();
+        return std::string_view(start, p - start);
+    }
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::runtime_error("JSON parse error: " + message);
+    }
+
+private:
+    static bool is_ws(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void skip_ws() {
+        while (p < end && is_ws(*p)) {
+            p++;
+        }
+    }
+
+    // The first item after an opening bracket has no comma before it; every later one must.
+    bool next_item(char close) {
+        bool first = opened;
+        opened = false;
+        if (consume(close)) {
+            return false;
+        }
+        if (p >= end) {
+            fail("unexpected end of input");
+        }
+        if (!first && !consume(',')) {
+            fail(std::string("expected ',' or '") + close + "'");
+        }
+        return true;
+    }
+
+    void skip_string() {
+        expect('"');
+        while (p < end && *p != '"') {
+            p += *p == '\\' ? 2 : 1;
+        }
+        if (p >= end) {
+            fail("unterminated string");
+        }
+        p++;
+    }
+
+    uint32_t read_hex4() {
+        if (end - p < 4) {
+            fail("truncated \\u escape");
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *p++;
+            value <<= 4;
+            if (c >= '0' && c <= '9') value |= c - '0';
+            else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+            else fail("invalid \\u escape");
+        }
+        return value;
+    }
+
+    uint32_t read_codepoint() {
+        uint32_t cp = read_hex4();
+        if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+            p += 2;
+            uint32_t low = read_hex4();
+            if (low >= 0xDC00 && low < 0xE000) {
+                return 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            fail("invalid surrogate pair");
+        }
+        return cp;
+    }
+
+    static void append_utf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    const char* p;
+    const char* end;
+    bool opened = false;
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "bpe.hpp"
+
+#include <thread>
+
+// How often each token id is emitted when `sample` is encoded. The sample is cut into one range per thread where
+// encode may split it (FrozenTokenizer::next_split), so the counts do not depend on num_threads; a sample with no
+// such cut, such as one without special tokens under the `none` pre-tokenizer, is counted on one thread. Each
+// thread counts into its own table.
+inline std::vector<int64_t> count_token_usage(const FrozenTokenizer& tokenizer, std::string_view sample,
+                                              int num_threads) {
+    size_t workers = std::max<size_t>(1, std::min<size_t>(num_threads, sample.size() / (1 << 16)));
+    std::vector<size_t> bounds = {0};
+    for (size_t w = 1; w < workers; ++w) {
+        size_t cut = tokenizer.next_split(sample, std::max(bounds.back() + 1, sample.size() * w / workers));
+        if (cut >= sample.size()) break;
+        bounds.push_back(cut);
+    }
+    bounds.push_back(sample.size());
+    workers = bounds.size() - 1;
+
+    std::vector<std::vector<int64_t>> partial(workers, std::vector<int64_t>(tokenizer.vocab_size(), 0));
+    auto count_range = [&](size_t w) {
+        TraceSpan span("count_usage", "prune");
+        span.arg("bytes", bounds[w + 1] - bounds[w]);
+        std::vector<int> ids;
+        tokenizer.encode(sample.substr(bounds[w], bounds[w + 1] - bounds[w]), ids);
+        for (int id : ids) {
+            partial[w][id]++;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; ++w) {
+        threads.emplace_back(count_range, w);
+    }
+    count_range(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (size_t w = 1; w < workers; ++w) {
+        for (size_t id = 0; id < partial[0].size(); ++id) {
+            partial[0][id] += partial[w][id];
+        }
+    }
+    return partial[0];
+}
+
+struct PrunedVocab {
+    BPETokenizer tokenizer;
+    // New id of every old id, or -1 if the token was pruned.
+    std::vector<int> id_map;
+};
+
+// Drops the tokens used fewer than min_count times, except byte tokens, special tokens, ids without text (reserved
+// ids and the rest of the special space) and the parts of tokens that are kept, so every kept merge still has both
+// of its inputs. The remaining tokens keep their order, so merge ranks are unchanged, and are renumbered without
+// gaps; the special space starts at the new id of its old start. With min_count 1 only tokens that never appear in
+// the sample are dropped; none of them can form while encoding it, so the sample encodes to the same tokens as
+// before.
+inline PrunedVocab prune_vocabulary(const BPETokenizer& tokenizer, const std::vector<int64_t>& usage,
+                                    int64_t min_count = 1) {
+    int vocab_size = tokenizer.vocab_size();
+    std::vector<char> keep(vocab_size, 0);
+    for (int id = 0; id < vocab_size; ++id) {
+        keep[id] = usage[id] >= min_count;
+    }
+    for (int id : tokenizer.byte_table()) {
+        keep[id] = 1;
+    }
+    for (const auto& [_, id] : tokenizer.special_tokens()) {
+        keep[id] = 1;
+    }
+    for (int id = 256; id < vocab_size; ++id) {
+        keep[id] |= tokenizer.token(id).empty();
+    }
+    std::vector<Merge> merges = tokenizer.merges();
+    for (auto it = merges.rbegin(); it != merges.rend(); ++it) {
+        if (keep[it->id]) {
+            keep[it->left] = keep[it->right] = 1;
+        }
+    }
+
+    std::vector<int> id_map(vocab_size, -1);
+    std::vector<char> bytes;
+    std::vector<uint32_t> offsets = {0};
+    int special_space = 0;
+    for (int id = 0; id < vocab_size; ++id) {
+        special_space += id < tokenizer.special_space_start() && keep[id];
+        if (!keep[id]) continue;
+        id_map[id] = static_cast<int>(offsets.size()) - 1;
+        std::string_view token = tokenizer.token(id);
+        bytes.insert(bytes.end(), token.begin(), token.end());
+        offsets.push_back(static_cast<uint32_t>(bytes.size()));
+    }
+    std::array<int, 256> byte_ids;
+    for (int b = 0; b < 256; ++b) {
+        byte_ids[b] = id_map[tokenizer.byte_table()[b]];
+    }
+    std::vector<Merge> kept;
+    for (const Merge& merge : merges) {
+        if (keep[merge.id]) {
+            kept.push_back({id_map[merge.left], id_map[merge.right], id_map[merge.id]});
+        }
+    }
+
+    BPETokenizer pruned = BPETokenizer::from_tables(tokenizer.pre_tokenizer_mode(), std::move(bytes),
+                                                    std::move(offsets), byte_ids, kept, special_space);
+    for (const auto& [token, id] : tokenizer.special_tokens()) {
+        pruned.add_special_token(token, id_map[id]);
+    }
+    return {std::move(pruned), std::move(id_map)};
+}
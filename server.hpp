@@ -0,0 +1,686 @@
+#pragma once
+
+#include "bpe.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Frames in both directions: u32 payload length, u32 request id, u8 op (requests) or status (responses), payload.
+// encode: text -> u32 ids; decode: u32 ids -> text; count: text -> u32 token count; errors carry a message.
+enum RequestOp : uint8_t {
+    OP_ENCODE = 1,
+    OP_DECODE = 2,
+    OP_COUNT = 3,
+};
+
+enum ResponseStatus : uint8_t {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1,
+};
+
+const size_t FRAME_HEADER_SIZE = 9;
+const uint32_t MAX_FRAME_PAYLOAD = 64 << 20;
+const size_t CONNECTION_BUFFER = 64 << 10;
+const int MAX_SEND_BUFFERS = 64;
+
+struct ServerOptions {
+    std::string socket_path = "/tmp/bpe.sock";
+    int num_threads = 4;
+    size_t max_batch = 256;
+    // How long the first request of a batch may wait for more to join it.
+    int batch_wait_ms = 0;
+    // Special-token policy for encode and count; client text is untrusted, so `none` or `raise` keeps it from
+    // injecting special ids.
+    SpecialMode specials = SpecialMode::all;
+    std::vector<std::string> allowed_specials;
+};
+
+inline void put_u32(char* out, uint32_t value) {
+    std::memcpy(out, &value, sizeof(value));
+}
+
+inline uint32_t get_u32(const char* in) {
+    uint32_t value;
+    std::memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+inline void append_frame_header(std::string& out, uint32_t length, uint32_t id, uint8_t code) {
+    char header[FRAME_HEADER_SIZE];
+    put_u32(header, length);
+    put_u32(header + 4, id);
+    header[8] = static_cast<char>(code);
+    out.append(header, sizeof(header));
+}
+
+inline sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::invalid_argument("Socket path too long: " + path);
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+// Unix-domain-socket server. One thread runs the epoll loop: it reads into per-connection buffers, cuts complete
+// frames out of them in place and collects the requests of all ready connections into a batch, which is split
+// across the worker pool. Request payloads are views into the connection buffer, so a connection is not read again
+// until all of its requests have been answered. Responses are queued back through an eventfd, moved onto their
+// connection and sent with one sendmsg over the queued buffers. A client that shuts down its write side still gets
+// answers to everything it sent before; the connection is closed once they have been sent.
+class TokenizerServer {
+public:
+    TokenizerServer(const FrozenTokenizer& tokenizer, const ServerOptions& opts)
+        : tokenizer(tokenizer), opts(opts), policy(tokenizer.special_policy(opts.specials, opts.allowed_specials)) {}
+
+    ~TokenizerServer() {
+        stop_workers();
+        for (auto& [fd, conn] : connections) {
+            ::close(fd);
+        }
+        for (int fd : {listen_fd, epoll_fd, event_fd, signal_fd}) {
+            if (fd >= 0) ::close(fd);
+        }
+        if (listen_fd >= 0) {
+            ::unlink(opts.socket_path.c_str());
+        }
+    }
+
+    TokenizerServer(const TokenizerServer&) = delete;
+    TokenizerServer& operator=(const TokenizerServer&) = delete;
+
+    // Serves until SIGINT or SIGTERM.
+    void run() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        signal_fd = check(signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC), "signalfd");
+
+        listen_fd = check(::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket");
+        sockaddr_un addr = unix_address(opts.socket_path);
+        ::unlink(opts.socket_path.c_str());
+        check(::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), "bind " + opts.socket_path);
+        check(::listen(listen_fd, SOMAXCONN), "listen");
+
+        event_fd = check(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd");
+        epoll_fd = check(epoll_create1(EPOLL_CLOEXEC), "epoll_create1");
+        for (int fd : {listen_fd, event_fd, signal_fd}) {
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+        }
+        for (int i = 0; i < std::max(1, opts.num_threads); ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+
+        std::vector<epoll_event> events(256);
+        bool running = true;
+        while (running) {
+            int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), batch_timeout());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("epoll_wait: ") + std::strerror(errno));
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd) {
+                    accept_connections();
+                } else if (fd == event_fd) {
+                    deliver_responses();
+                } else if (fd == signal_fd) {
+                    running = false;
+                } else {
+                    auto it = connections.find(fd);
+                    if (it == connections.end()) continue;
+                    ServerConnection& conn = *it->second;
+                    if (conn.in_flight > 0 && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                        close_connection(conn);
+                    } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+                        read_connection(conn);
+                    }
+                    if (!conn.closed && (events[i].events & EPOLLOUT)) {
+                        flush(conn);
+                    }
+                    release_if_done(conn);
+                }
+            }
+            if (!batch.empty() && (opts.batch_wait_ms <= 0 || batch_timeout() == 0)) {
+                dispatch();
+            }
+        }
+    }
+
+private:
+    struct ServerConnection {
+        int fd;
+        std::vector<char> in = std::vector<char>(CONNECTION_BUFFER);
+        size_t in_size = 0;
+        size_t parsed = 0;
+        // Responses not yet sent, in request order; out_sent bytes of the first have gone out.
+        std::deque<std::string> out;
+        size_t out_sent = 0;
+        int in_flight = 0;
+        bool eof = false;
+        bool closed = false;
+    };
+
+    struct ServerRequest {
+        ServerConnection* conn;
+        uint32_t id;
+        uint8_t op;
+        std::string_view payload;
+        std::string response;
+    };
+
+    struct Batch {
+        std::vector<ServerRequest> requests;
+        std::atomic<size_t> remaining{0};
+    };
+
+    struct Job {
+        std::shared_ptr<Batch> batch;
+        size_t begin;
+        size_t end;
+    };
+
+    static int check(int result, const std::string& what) {
+        if (result < 0) {
+            throw std::runtime_error(what + ": " + std::strerror(errno));
+        }
+        return result;
+    }
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        check(epoll_ctl(epoll_fd, op, fd, &event), "epoll_ctl");
+    }
+
+    // Milliseconds until the pending batch is due, rounded up; -1 without one.
+    int batch_timeout() const {
+        if (batch.empty()) {
+            return -1;
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(batch_deadline - std::chrono::steady_clock::now());
+        return static_cast<int>(std::max<int64_t>(0, left.count()));
+    }
+
+    void update_events(ServerConnection& conn) {
+        if (conn.closed) {
+            return;
+        }
+        if (conn.eof && conn.in_flight == 0 && conn.out.empty()) {
+            close_connection(conn);
+            return;
+        }
+        uint32_t events = conn.in_flight == 0 && !conn.eof ? EPOLLIN | EPOLLRDHUP : 0;
+        if (!conn.out.empty()) events |= EPOLLOUT;
+        watch(conn.fd, events, EPOLL_CTL_MOD);
+    }
+
+    // Stops watching the connection; it is closed once its last in-flight request has been answered.
+    void close_connection(ServerConnection& conn) {
+        if (!conn.closed) {
+            conn.closed = true;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        }
+    }
+
+    void accept_connections() {
+        while (true) {
+            int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                throw std::runtime_error(std::string("accept: ") + std::strerror(errno));
+            }
+            auto conn = std::make_unique<ServerConnection>();
+            conn->fd = fd;
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+            connections[fd] = std::move(conn);
+        }
+    }
+
+    void read_connection(ServerConnection& conn) {
+        if (conn.in_flight > 0) {
+            return;
+        }
+        while (!conn.closed && !conn.eof && conn.in_size < conn.in.size()) {
+            ssize_t n = ::read(conn.fd, conn.in.data() + conn.in_size, conn.in.size() - conn.in_size);
+            if (n > 0) {
+                conn.in_size += n;
+            } else if (n == 0) {
+                conn.eof = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                close_connection(conn);
+            }
+        }
+        parse_requests(conn);
+    }
+
+    void parse_requests(ServerConnection& conn) {
+        while (!conn.closed && conn.in_size - conn.parsed >= FRAME_HEADER_SIZE) {
+            const char* frame = conn.in.data() + conn.parsed;
+            uint32_t length = get_u32(frame);
+            if (length > MAX_FRAME_PAYLOAD) {
+                close_connection(conn);
+                break;
+            }
+            if (conn.in_size - conn.parsed < FRAME_HEADER_SIZE + length) {
+                if (conn.parsed == 0 && FRAME_HEADER_SIZE + length > conn.in.size()) {
+                    conn.in.resize(std::max(FRAME_HEADER_SIZE + length, conn.in.size() * 2));
+                }
+                break;
+            }
+            if (batch.empty()) {
+                batch_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(opts.batch_wait_ms);
+            }
+            batch.push_back({&conn, get_u32(frame + 4), static_cast<uint8_t>(frame[8]),
+                             std::string_view(frame + FRAME_HEADER_SIZE, length), std::string()});
+            conn.parsed += FRAME_HEADER_SIZE + length;
+            conn.in_flight++;
+            if (batch.size() >= opts.max_batch) {
+                dispatch();
+            }
+        }
+        update_events(conn);
+    }
+
+    void dispatch() {
+        auto shared = std::make_shared<Batch>();
+        shared->requests = std::move(batch);
+        batch.clear();
+        size_t total = 0;
+        for (const ServerRequest& request : shared->requests) {
+            total += request.payload.size() + 1;
+        }
+        size_t workers_used = std::min(shared->requests.size(), workers.size());
+        std::vector<Job> jobs;
+        size_t begin = 0, bytes = 0;
+        for (size_t i = 0; i < shared->requests.size(); ++i) {
+            bytes += shared->requests[i].payload.size() + 1;
+            bool last = i + 1 == shared->requests.size();
+            if (last || bytes * workers_used >= total * (jobs.size() + 1)) {
+                jobs.push_back({shared, begin, i + 1});
+                begin = i + 1;
+            }
+        }
+        shared->remaining = jobs.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Job& job : jobs) {
+                this->jobs.push_back(std::move(job));
+            }
+        }
+        work_ready.notify_all();
+    }
+
+    void work() {
+        EncodeScratch scratch;
+        std::vector<int> ids;
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            for (size_t i = job.begin; i < job.end; ++i) {
+                handle(job.batch->requests[i], scratch, ids);
+            }
+            if (--job.batch->remaining == 0) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done.push_back(std::move(job.batch));
+                }
+                uint64_t one = 1;
+                while (::write(event_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+                }
+            }
+        }
+    }
+
+    void handle(ServerRequest& request, EncodeScratch& scratch, std::vector<int>& ids) const {
+        std::string& out = request.response;
+        try {
+            if (request.op == OP_ENCODE || request.op == OP_COUNT) {
+                ids.clear();
+                tokenizer.encode(request.payload, ids, scratch, policy);
+                if (request.op == OP_COUNT) {
+                    append_frame_header(out, sizeof(uint32_t), request.id, STATUS_OK);
+                    char count[4];
+                    put_u32(count, static_cast<uint32_t>(ids.size()));
+                    out.append(count, sizeof(count));
+                    return;
+                }
+                append_frame_header(out, ids.size() * sizeof(uint32_t), request.id, STATUS_OK);
+                size_t offset = out.size();
+                out.resize(offset + ids.size() * sizeof(uint32_t));
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    put_u32(&out[offset + i * sizeof(uint32_t)], static_cast<uint32_t>(ids[i]));
+                }
+            } else if (request.op == OP_DECODE) {
+                if (request.payload.size() % sizeof(uint32_t) != 0) {
+                    throw std::invalid_argument("decode payload is not a whole number of uint32 ids");
+                }
+                ids.resize(request.payload.size() / sizeof(uint32_t));
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    ids[i] = static_cast<int>(get_u32(request.payload.data() + i * sizeof(uint32_t)));
+                }
+                std::string text = tokenizer.decode(ids);
+                append_frame_header(out, text.size(), request.id, STATUS_OK);
+                out += text;
+            } else {
+                throw std::invalid_argument("unknown op " + std::to_string(request.op));
+            }
+        } catch (const std::exception& e) {
+            out.clear();
+            std::string message = e.what();
+            append_frame_header(out, message.size(), request.id, STATUS_ERROR);
+            out += message;
+        }
+    }
+
+    void deliver_responses() {
+        uint64_t count;
+        while (::read(event_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+        std::deque<std::shared_ptr<Batch>> finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.swap(done);
+        }
+        std::vector<ServerConnection*> touched;
+        for (const auto& finished_batch : finished) {
+            for (ServerRequest& request : finished_batch->requests) {
+                ServerConnection& conn = *request.conn;
+                if (!conn.closed) {
+                    conn.out.push_back(std::move(request.response));
+                }
+                if (--conn.in_flight == 0) {
+                    touched.push_back(&conn);
+                }
+            }
+        }
+        for (ServerConnection* conn : touched) {
+            if (!conn->closed) {
+                std::memmove(conn->in.data(), conn->in.data() + conn->parsed, conn->in_size - conn->parsed);
+                conn->in_size -= conn->parsed;
+                conn->parsed = 0;
+                flush(*conn);
+                parse_requests(*conn);
+            }
+            release_if_done(*conn);
+        }
+    }
+
+    void flush(ServerConnection& conn) {
+        iovec buffers[MAX_SEND_BUFFERS];
+        while (!conn.out.empty()) {
+            int count = 0;
+            for (auto it = conn.out.begin(); it != conn.out.end() && count < MAX_SEND_BUFFERS; ++it, ++count) {
+                size_t skip = count == 0 ? conn.out_sent : 0;
+                buffers[count].iov_base = &(*it)[skip];
+                buffers[count].iov_len = it->size() - skip;
+            }
+            msghdr message{};
+            message.msg_iov = buffers;
+            message.msg_iovlen = count;
+            ssize_t n = ::sendmsg(conn.fd, &message, MSG_NOSIGNAL);
+            if (n >= 0) {
+                conn.out_sent += n;
+                while (!conn.out.empty() && conn.out_sent >= conn.out.front().size()) {
+                    conn.out_sent -= conn.out.front().size();
+                    conn.out.pop_front();
+                }
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                close_connection(conn);
+                return;
+            }
+        }
+        update_events(conn);
+    }
+
+    void release_if_done(ServerConnection& conn) {
+        if (conn.closed && conn.in_flight == 0) {
+            int fd = conn.fd;
+            ::close(fd);
+            connections.erase(fd);
+        }
+    }
+
+    void stop_workers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    const FrozenTokenizer& tokenizer;
+    ServerOptions opts;
+    SpecialPolicy policy;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int event_fd = -1;
+    int signal_fd = -1;
+    std::unordered_map<int, std::unique_ptr<ServerConnection>> connections;
+    std::vector<ServerRequest> batch;
+    std::chrono::steady_clock::time_point batch_deadline;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::deque<Job> jobs;
+    std::deque<std::shared_ptr<Batch>> done;
+    bool stopping = false;
+};
+
+// Blocking client for the server protocol.
+class TokenizerClient {
+public:
+    explicit TokenizerClient(const std::string& socket_path) {
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = unix_address(socket_path);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::string error = std::strerror(errno);
+            if (fd >= 0) ::close(fd);
+            throw std::runtime_error("Error connecting to " + socket_path + ": " + error);
+        }
+    }
+
+    ~TokenizerClient() {
+        ::close(fd);
+    }
+
+    TokenizerClient(const TokenizerClient&) = delete;
+    TokenizerClient& operator=(const TokenizerClient&) = delete;
+
+    void send(uint32_t id, uint8_t op, std::string_view payload) {
+        frame.clear();
+        append_frame_header(frame, payload.size(), id, op);
+        frame.append(payload.data(), payload.size());
+        write_all(frame.data(), frame.size());
+    }
+
+    // Sends one request and waits for its response; returns the status.
+    uint8_t call(uint8_t op, std::string_view payload, std::string& response) {
+        uint32_t id;
+        send(next_id, op, payload);
+        uint8_t status = receive(id, response);
+        if (id != next_id++) {
+            throw std::runtime_error("Response id does not match the request");
+        }
+        return status;
+    }
+
+    // Returns the status; the payload is left in `payload`.
+    uint8_t receive(uint32_t& id, std::string& payload) {
+        char header[FRAME_HEADER_SIZE];
+        read_all(header, sizeof(header));
+        id = get_u32(header + 4);
+        payload.resize(get_u32(header));
+        read_all(&payload[0], payload.size());
+        return static_cast<uint8_t>(header[8]);
+    }
+
+private:
+    void write_all(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Error sending request: ") + std::strerror(errno));
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    void read_all(char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::read(fd, data, size);
+            if (n == 0) {
+                throw std::runtime_error("Server closed the connection");
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Error reading response: ") + std::strerror(errno));
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    int fd;
+    uint32_t next_id = 0;
+    std::string frame;
+};
+
+struct LoadOptions {
+    std::string socket_path = "/tmp/bpe.sock";
+    uint8_t op = OP_ENCODE;
+    int connections = 8;
+    size_t requests = 100000;
+};
+
+struct LoadStats {
+    size_t requests = 0;
+    size_t errors = 0;
+    size_t bytes = 0;
+    double seconds = 0.0;
+    double p50_us = 0.0;
+    double p99_us = 0.0;
+    double max_us = 0.0;
+};
+
+// Closed-loop load: each connection sends one request at a time, cycling through `payloads` from its own offset.
+// `connect()` returns a new client (anything with `call(op, payload, response)`). For OP_DECODE the payloads are
+// first encoded through the server and the decoded text is checked against them.
+template <class Connect>
+LoadStats run_load_generator(const std::vector<std::string>& payloads, const LoadOptions& opts, Connect connect) {
+    if (payloads.empty()) {
+        throw std::invalid_argument("Load generator needs at least one request payload");
+    }
+    std::vector<std::string> requests = payloads;
+    if (opts.op == OP_DECODE) {
+        auto client = connect();
+        for (size_t i = 0; i < payloads.size(); ++i) {
+            if (client->call(OP_ENCODE, payloads[i], requests[i]) != STATUS_OK) {
+                throw std::runtime_error("Encode failed while preparing decode requests: " + requests[i]);
+            }
+        }
+    }
+
+    int num_connections = std::max(1, opts.connections);
+    std::vector<decltype(connect())> clients;
+    for (int c = 0; c < num_connections; ++c) {
+        clients.push_back(connect());
+    }
+    std::vector<std::vector<double>> latencies(num_connections);
+    std::vector<size_t> errors(num_connections, 0), bytes(num_connections, 0);
+    std::vector<std::exception_ptr> failures(num_connections);
+    auto run_connection = [&](int c) {
+        std::string response;
+        size_t count = opts.requests / num_connections + (static_cast<size_t>(c) < opts.requests % num_connections);
+        latencies[c].reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = (c * 7919 + i) % requests.size();
+            auto sent = std::chrono::steady_clock::now();
+            uint8_t status = clients[c]->call(opts.op, requests[index], response);
+            latencies[c].push_back(
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+            bytes[c] += requests[index].size();
+            if (status != STATUS_OK || (opts.op == OP_DECODE && response != payloads[index])) {
+                errors[c]++;
+            }
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int c = 0; c < num_connections; ++c) {
+        threads.emplace_back([&, c] {
+            try {
+                run_connection(c);
+            } catch (...) {
+                failures[c] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& failure : failures) {
+        if (failure) std::rethrow_exception(failure);
+    }
+
+    LoadStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<double> all;
+    for (int c = 0; c < num_connections; ++c) {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+        stats.errors += errors[c];
+        stats.bytes += bytes[c];
+    }
+    stats.requests = all.size();
+    if (!all.empty()) {
+        std::sort(all.begin(), all.end());
+        stats.p50_us = all[all.size() / 2];
+        stats.p99_us = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+        stats.max_us = all.back();
+    }
+    return stats;
+}
+
+inline LoadStats run_load_generator(const std::vector<std::string>& payloads, const LoadOptions& opts) {
+    return run_load_generator(payloads, opts, [&] { return std::make_unique<TokenizerClient>(opts.socket_path); });
+}
@@ -0,0 +1,421 @@
+#pragma once
+
+#include "bpe.hpp"
+#include "json.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <unistd.h>
+
+const size_t SHARD_WRITE_BUFFER = 16 << 20;
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+const uint32_t SHARD_INDEX_MAGIC = 0x58444942;
+const uint32_t SHARD_INDEX_VERSION = 1;
+
+struct ShardOptions {
+    std::string prefix = "tokens";
+    int token_bytes = 2;
+    uint64_t shard_tokens = 100000000;
+    bool direct_io = false;
+    bool jsonl = false;
+    std::string text_field = "text";
+    std::string separator = "<|endoftext|>";
+    int num_threads = 1;
+    size_t batch_bytes = 4 << 20;
+    double dropout = 0.0;
+    uint64_t seed = 0;
+    // Special-token text inside a document is encoded as ordinary text (`none`) or rejected (`raise`); the only
+    // special ids in the shards are the separators between documents.
+    SpecialMode specials = SpecialMode::none;
+};
+
+struct ShardStats {
+    uint64_t documents = 0;
+    uint64_t tokens = 0;
+    uint64_t shards = 0;
+};
+
+class DocumentReader {
+public:
+    DocumentReader(const std::vector<std::string>& paths, bool jsonl, const std::string& text_field)
+        : paths(paths), jsonl(jsonl), text_field(text_field), line_buffer(SHARD_WRITE_BUFFER) {}
+
+    bool next_batch(std::vector<std::string>& docs, size_t batch_bytes) {
+        docs.clear();
+        size_t bytes = 0;
+        std::string doc;
+        while (bytes < batch_bytes && next_document(doc)) {
+            bytes += doc.size();
+            docs.push_back(std::move(doc));
+        }
+        return !docs.empty();
+    }
+
+private:
+    bool next_document(std::string& doc) {
+        if (!jsonl) {
+            if (next_path >= paths.size()) {
+                return false;
+            }
+            std::ifstream file(paths[next_path], std::ios::binary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Error opening " + paths[next_path]);
+            }
+            std::stringstream buffer;
+            buffer << file.rdbuf();
+            doc = buffer.str();
+            next_path++;
+            return true;
+        }
+
+        std::string line;
+        while (true) {
+            if (!file.is_open()) {
+                if (next_path >= paths.size()) {
+                    return false;
+                }
+                file.rdbuf()->pubsetbuf(line_buffer.data(), line_buffer.size());
+                file.open(paths[next_path], std::ios::binary);
+                if (!file.is_open()) {
+                    throw std::runtime_error("Error opening " + paths[next_path]);
+                }
+                line_number = 0;
+            }
+            if (!std::getline(file, line)) {
+                file.close();
+                file.clear();
+                next_path++;
+                continue;
+            }
+            line_number++;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            std::string location = paths[next_path] + ":" + std::to_string(line_number) + ": ";
+            bool found;
+            try {
+                found = extract_text(line, doc);
+            } catch (const std::runtime_error& e) {
+                throw std::runtime_error(location + e.what());
+            }
+            if (found) {
+                return true;
+            }
+            throw std::runtime_error(location + "missing string field \"" + text_field + "\"");
+        }
+    }
+
+    bool extract_text(const std::string& line, std::string& doc) {
+        JsonReader reader(line);
+        reader.expect('{');
+        while (reader.next_member(key)) {
+            if (key == text_field && reader.peek() == '"') {
+                reader.read_string(doc);
+                return true;
+            }
+            reader.skip_value();
+        }
+        return false;
+    }
+
+    std::vector<std::string> paths;
+    bool jsonl;
+    std::string text_field;
+    size_t next_path = 0;
+    std::ifstream file;
+    std::vector<char> line_buffer;
+    size_t line_number = 0;
+    std::string key;
+};
+
+struct EncodedBatch {
+    std::vector<char> bytes;
+    std::vector<uint64_t> doc_tokens;
+};
+
+// Document i of the input is encoded with dropout seeded by opts.seed + i, so shards do not depend on how the
+// documents were batched or on the number of threads.
+inline EncodedBatch encode_documents(const FrozenTokenizer& tokenizer, const std::vector<std::string>& docs,
+                                     uint64_t first_document, int separator_id, const SpecialPolicy& policy,
+                                     const ShardOptions& opts) {
+    TraceSpan span("encode_documents", "shard");
+    span.arg("first_document", first_document);
+    span.arg("documents", docs.size());
+    int token_bytes = opts.token_bytes;
+    EncodedBatch batch;
+    EncodeScratch scratch;
+    MergeDropout dropout(opts.dropout, opts.seed);
+    std::vector<int> ids;
+    for (size_t i = 0; i < docs.size(); ++i) {
+        const std::string& doc = docs[i];
+        ids.clear();
+        try {
+            if (opts.dropout > 0.0) {
+                dropout.reseed(opts.seed + first_document + i);
+                tokenizer.encode(doc, ids, scratch, dropout, policy);
+            } else {
+                tokenizer.encode(doc, ids, scratch, policy);
+            }
+        } catch (const std::invalid_argument& e) {
+            throw std::invalid_argument("Document " + std::to_string(first_document + i) + ": " + e.what());
+        }
+        ids.push_back(separator_id);
+        size_t offset = batch.bytes.size();
+        batch.bytes.resize(offset + ids.size() * token_bytes);
+        char* out = batch.bytes.data() + offset;
+        for (int id : ids) {
+            if (token_bytes == 2) {
+                uint16_t value = static_cast<uint16_t>(id);
+                std::memcpy(out, &value, sizeof(value));
+            } else {
+                uint32_t value = static_cast<uint32_t>(id);
+                std::memcpy(out, &value, sizeof(value));
+            }
+            out += token_bytes;
+        }
+        batch.doc_tokens.push_back(ids.size());
+    }
+    return batch;
+}
+
+class ShardWriter {
+public:
+    ShardWriter(const std::string& prefix, uint64_t shard_bytes, bool direct_io)
+        : prefix(prefix), shard_bytes(shard_bytes), direct_io(direct_io) {
+        if (posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, SHARD_WRITE_BUFFER) != 0) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~ShardWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        std::free(buffer);
+    }
+
+    ShardWriter(const ShardWriter&) = delete;
+    ShardWriter& operator=(const ShardWriter&) = delete;
+
+    void write(const char* data, size_t size) {
+        while (size > 0) {
+            if (fd < 0) {
+                open_shard();
+            }
+            size_t n = std::min<uint64_t>({size, SHARD_WRITE_BUFFER - used, shard_bytes - shard_written});
+            std::memcpy(static_cast<char*>(buffer) + used, data, n);
+            used += n;
+            shard_written += n;
+            data += n;
+            size -= n;
+            if (used == SHARD_WRITE_BUFFER) {
+                flush();
+            }
+            if (shard_written == shard_bytes) {
+                close_shard();
+            }
+        }
+    }
+
+    void finish() {
+        if (fd >= 0) {
+            close_shard();
+        }
+    }
+
+    uint64_t num_shards() const {
+        return shards;
+    }
+
+    static std::string shard_path(const std::string& prefix, uint64_t index) {
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), "_%06llu.bin", static_cast<unsigned long long>(index));
+        return prefix + suffix;
+    }
+
+private:
+    void open_shard() {
+        std::string path = shard_path(prefix, shards);
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (direct_io) {
+            flags |= O_DIRECT;
+        }
+        fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Error opening " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    void flush() {
+        size_t size = used;
+        if (direct_io) {
+            size = (used + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+            std::memset(static_cast<char*>(buffer) + used, 0, size - used);
+        }
+        const char* data = static_cast<const char*>(buffer);
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Error writing shard: ") + std::strerror(errno));
+            }
+            data += n;
+            size -= n;
+        }
+        used = 0;
+    }
+
+    void close_shard() {
+        flush();
+        if (direct_io && ::ftruncate(fd, shard_written) != 0) {
+            throw std::runtime_error(std::string("Error truncating shard: ") + std::strerror(errno));
+        }
+        ::close(fd);
+        fd = -1;
+        shard_written = 0;
+        shards++;
+    }
+
+    std::string prefix;
+    uint64_t shard_bytes;
+    bool direct_io;
+    void* buffer = nullptr;
+    size_t used = 0;
+    int fd = -1;
+    uint64_t shard_written = 0;
+    uint64_t shards = 0;
+};
+
+class ShardIndex {
+public:
+    ShardIndex(const std::string& path, const ShardOptions& opts, int separator_id) : buffer(1 << 20) {
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("Error opening " + path);
+        }
+        std::setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+        put<uint32_t>(SHARD_INDEX_MAGIC);
+        put<uint32_t>(SHARD_INDEX_VERSION);
+        put<uint32_t>(opts.token_bytes);
+        put<int32_t>(separator_id);
+        put<uint64_t>(opts.shard_tokens);
+        put<uint64_t>(0);
+        put<uint64_t>(0);
+    }
+
+    ~ShardIndex() {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+
+    ShardIndex(const ShardIndex&) = delete;
+    ShardIndex& operator=(const ShardIndex&) = delete;
+
+    void add_document(uint64_t num_tokens) {
+        put<uint64_t>(total_tokens);
+        total_tokens += num_tokens;
+        documents++;
+    }
+
+    void finish() {
+        put<uint64_t>(total_tokens);
+        std::fseek(file, 3 * sizeof(uint32_t) + sizeof(int32_t) + sizeof(uint64_t), SEEK_SET);
+        put<uint64_t>(documents);
+        put<uint64_t>(total_tokens);
+        if (std::fclose(file) != 0) {
+            file = nullptr;
+            throw std::runtime_error("Error writing shard index");
+        }
+        file = nullptr;
+    }
+
+    uint64_t num_documents() const {
+        return documents;
+    }
+
+    uint64_t num_tokens() const {
+        return total_tokens;
+    }
+
+private:
+    template <class T>
+    void put(T value) {
+        if (std::fwrite(&value, sizeof(T), 1, file) != 1) {
+            throw std::runtime_error("Error writing shard index");
+        }
+    }
+
+    FILE* file = nullptr;
+    std::vector<char> buffer;
+    uint64_t documents = 0;
+    uint64_t total_tokens = 0;
+};
+
+inline ShardStats write_token_shards(const FrozenTokenizer& tokenizer, const std::vector<std::string>& inputs,
+                                     const ShardOptions& opts) {
+    if (opts.token_bytes != 2 && opts.token_bytes != 4) {
+        throw std::invalid_argument("Token width must be 2 (uint16) or 4 (uint32) bytes");
+    }
+    if (opts.token_bytes == 2 && tokenizer.vocab_size() > 65536) {
+        throw std::invalid_argument("Vocabulary size " + std::to_string(tokenizer.vocab_size()) +
+                                    " does not fit in uint16 tokens");
+    }
+    if (opts.shard_tokens == 0) {
+        throw std::invalid_argument("Shard size must be at least one token");
+    }
+    int separator_id = tokenizer.special_token_id(opts.separator);
+    if (separator_id < 0) {
+        throw std::invalid_argument("Model has no special token " + opts.separator);
+    }
+    if (opts.specials != SpecialMode::none && opts.specials != SpecialMode::raise) {
+        throw std::invalid_argument("Shard documents take the none or raise special-token policy");
+    }
+    SpecialPolicy policy = tokenizer.special_policy(opts.specials);
+
+    DocumentReader reader(inputs, opts.jsonl, opts.text_field);
+    ShardWriter writer(opts.prefix, opts.shard_tokens * opts.token_bytes, opts.direct_io);
+    ShardIndex index(opts.prefix + ".idx", opts, separator_id);
+    std::deque<std::future<EncodedBatch>> pending;
+    size_t max_pending = std::max(1, opts.num_threads);
+
+    auto write_front = [&] {
+        EncodedBatch batch = pending.front().get();
+        pending.pop_front();
+        for (uint64_t num_tokens : batch.doc_tokens) {
+            index.add_document(num_tokens);
+        }
+        writer.write(batch.bytes.data(), batch.bytes.size());
+    };
+
+    std::vector<std::string> docs;
+    uint64_t num_documents = 0;
+    while (reader.next_batch(docs, opts.batch_bytes)) {
+        uint64_t first = num_documents;
+        num_documents += docs.size();
+        pending.push_back(std::async(std::launch::async,
+                                     [&tokenizer, &opts, &policy, first, separator_id, docs = std::move(docs)] {
+                                         return encode_documents(tokenizer, docs, first, separator_id, policy, opts);
+                                     }));
+        docs.clear();
+        while (pending.size() > max_pending) {
+            write_front();
+        }
+    }
+    while (!pending.empty()) {
+        write_front();
+    }
+    writer.finish();
+    index.finish();
+
+    ShardStats stats;
+    stats.documents = index.num_documents();
+    stats.tokens = index.num_tokens();
+    stats.shards = writer.num_shards();
+    return stats;
+}
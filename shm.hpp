@@ -0,0 +1,536 @@
+#pragma once
+
+#include "server.hpp"
+
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Shared-memory transport for a tokenizer process on the same host. The segment is a ring of fixed-size slots.
+// Producers take tickets from a shared counter; ticket t owns slot t % num_slots for one round trip. Each slot's
+// state word encodes (ticket << 2) | phase and doubles as the futex word:
+//   free -> the producer copies text in -> requested -> a server thread writes the result over it -> done
+//   -> the producer copies the result out and frees the slot for ticket t + num_slots.
+// Server threads take tickets from a second counter, so requests are picked up in order but processed in parallel.
+// A producer claims ticket t by swapping the slot's owner word from (t, 0) to (t, pid), so a producer that dies
+// mid-request can be found: the server skips a ticket whose owner died before sending it, and the producer of
+// t + num_slots frees a slot whose owner died before taking its result. Whoever releases a slot hands over the
+// owner word first and publishes free second, so the claimer publishes free itself and a late release can only move
+// the state on from the one it left behind.
+// Ops and statuses are the socket protocol's; encode results are u32 ids, count a single u32.
+const uint32_t SHM_MAGIC = 0x324D4853;  // "SHM2"
+const uint32_t SLOT_FREE = 0;
+const uint32_t SLOT_REQUESTED = 1;
+const uint32_t SLOT_DONE = 2;
+
+struct ShmOptions {
+    std::string name = "/bpe";
+    int num_threads = 4;
+    uint32_t num_slots = 64;
+    uint32_t slot_bytes = 1 << 20;
+    SpecialMode specials = SpecialMode::all;
+    std::vector<std::string> allowed_specials;
+};
+
+struct alignas(64) ShmHeader {
+    std::atomic<uint32_t> magic;
+    uint32_t num_slots;
+    uint32_t slot_bytes;
+    int32_t server_pid;
+    std::atomic<uint32_t> stopping;
+    alignas(64) std::atomic<uint64_t> producer_ticket;
+    alignas(64) std::atomic<uint64_t> consumer_ticket;
+};
+
+struct alignas(64) ShmSlot {
+    std::atomic<uint64_t> owner;
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> waiters;
+    uint32_t op;
+    uint32_t status;
+    uint32_t length;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "Shared-memory rings need lock-free atomics");
+
+inline uint32_t slot_state(uint64_t ticket, uint32_t phase) {
+    return static_cast<uint32_t>(ticket << 2) | phase;
+}
+
+inline uint64_t slot_owner(uint64_t ticket, uint32_t pid) {
+    return (ticket << 32) | pid;
+}
+
+// A process that exited but has not been reaped by its parent still counts as alive.
+inline bool process_gone(uint32_t pid) {
+    return pid != 0 && ::kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH;
+}
+
+inline size_t slot_stride(uint32_t slot_bytes) {
+    return sizeof(ShmSlot) + (static_cast<size_t>(slot_bytes) + 63) / 64 * 64;
+}
+
+inline size_t segment_size(uint32_t num_slots, uint32_t slot_bytes) {
+    return sizeof(ShmHeader) + num_slots * slot_stride(slot_bytes);
+}
+
+// Maps a POSIX shared-memory segment; the creating side unlinks it again on destruction.
+class ShmSegment {
+public:
+    static ShmSegment create(const std::string& name, uint32_t num_slots, uint32_t slot_bytes) {
+        if (num_slots == 0 || num_slots > (1u << 20) || slot_bytes < sizeof(uint32_t)) {
+            throw std::invalid_argument("Invalid shared-memory ring size");
+        }
+        int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            if (!unlink_if_stale(name)) {
+                throw std::runtime_error("Shared memory " + name +
+                                         " already exists and is not a stopped server's ring");
+            }
+            fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        }
+        if (fd < 0) {
+            throw std::runtime_error("Error creating shared memory " + name + ": " + std::strerror(errno));
+        }
+        ShmSegment segment(name, fd, segment_size(num_slots, slot_bytes), true);
+        ShmHeader* header = new (segment.base) ShmHeader();
+        header->num_slots = num_slots;
+        header->slot_bytes = slot_bytes;
+        header->server_pid = ::getpid();
+        for (uint32_t i = 0; i < num_slots; ++i) {
+            new (segment.slot(i)) ShmSlot();
+            segment.slot(i)->owner.store(slot_owner(i, 0), std::memory_order_relaxed);
+            segment.slot(i)->state.store(slot_state(i, SLOT_FREE), std::memory_order_relaxed);
+        }
+        header->magic.store(SHM_MAGIC, std::memory_order_release);
+        return segment;
+    }
+
+    static ShmSegment attach(const std::string& name) {
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Error opening shared memory " + name + ": " + std::strerror(errno));
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Shared memory " + name + " is not a tokenizer ring");
+        }
+        ShmSegment segment(name, fd, st.st_size, false);
+        const ShmHeader& header = segment.header();
+        if (header.magic.load(std::memory_order_acquire) != SHM_MAGIC ||
+            segment_size(header.num_slots, header.slot_bytes) != segment.size) {
+            throw std::runtime_error("Shared memory " + name + " is not a tokenizer ring");
+        }
+        return segment;
+    }
+
+    ShmSegment(ShmSegment&& other) noexcept
+        : name(std::move(other.name)), base(other.base), size(other.size), owner(other.owner) {
+        other.base = nullptr;
+    }
+
+    ShmSegment(const ShmSegment&) = delete;
+    ShmSegment& operator=(const ShmSegment&) = delete;
+    ShmSegment& operator=(ShmSegment&&) = delete;
+
+    ~ShmSegment() {
+        if (base == nullptr) return;
+        ::munmap(base, size);
+        if (owner) {
+            ::shm_unlink(name.c_str());
+        }
+    }
+
+    ShmHeader& header() const {
+        return *reinterpret_cast<ShmHeader*>(base);
+    }
+
+    ShmSlot* slot(uint64_t ticket) const {
+        size_t index = ticket % header().num_slots;
+        return reinterpret_cast<ShmSlot*>(static_cast<char*>(base) + sizeof(ShmHeader) +
+                                          index * slot_stride(header().slot_bytes));
+    }
+
+    static char* slot_data(ShmSlot* slot) {
+        return reinterpret_cast<char*>(slot + 1);
+    }
+
+private:
+    // Removes a ring left behind by a server that died without unlinking it. A segment that is not a ring, or
+    // whose server is still running (or has not finished creating it), is left alone.
+    static bool unlink_if_stale(const std::string& name) {
+        int fd = ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return errno == ENOENT;
+        }
+        struct stat st;
+        void* base = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ShmHeader)) {
+            base = ::mmap(nullptr, sizeof(ShmHeader), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+        const ShmHeader& header = *static_cast<const ShmHeader*>(base);
+        bool stale = header.magic.load(std::memory_order_acquire) == SHM_MAGIC &&
+                     process_gone(static_cast<uint32_t>(header.server_pid));
+        ::munmap(base, sizeof(ShmHeader));
+        return stale && ::shm_unlink(name.c_str()) == 0;
+    }
+
+    ShmSegment(const std::string& name, int fd, size_t size, bool owner) : name(name), size(size), owner(owner) {
+        if (owner && ::ftruncate(fd, size) != 0) {
+            std::string error = std::strerror(errno);
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            throw std::runtime_error("Error sizing shared memory " + name + ": " + error);
+        }
+        base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            if (owner) ::shm_unlink(name.c_str());
+            throw std::runtime_error("Error mapping shared memory " + name + ": " + std::strerror(errno));
+        }
+    }
+
+    std::string name;
+    void* base = nullptr;
+    size_t size = 0;
+    bool owner = false;
+};
+
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t seen, long timeout_ns) {
+    timespec timeout{0, timeout_ns};
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, seen, &timeout, nullptr, 0);
+}
+
+inline void futex_wake_all(std::atomic<uint32_t>& word) {
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Publishes a new slot state; the futex syscall is only made when someone is asleep on the slot.
+inline void publish_slot(ShmSlot& slot, uint32_t state) {
+    slot.state.store(state, std::memory_order_seq_cst);
+    if (slot.waiters.load(std::memory_order_seq_cst) != 0) {
+        futex_wake_all(slot.state);
+    }
+}
+
+// Publishes `to` only if the slot is still in state `from`.
+inline void advance_slot(ShmSlot& slot, uint32_t from, uint32_t to) {
+    if (slot.state.compare_exchange_strong(from, to) && slot.waiters.load(std::memory_order_seq_cst) != 0) {
+        futex_wake_all(slot.state);
+    }
+}
+
+// Spins briefly, then sleeps on the slot's futex. Sleeps are bounded so that `give_up` (shutdown, a dead peer) is
+// noticed even when no one wakes the slot. Returns false if it gave up.
+template <class GiveUp>
+bool wait_for_slot(ShmSlot& slot, uint32_t expected, GiveUp give_up) {
+    const int SPINS = 200;
+    const long SLEEP_NS = 50 * 1000 * 1000;
+    for (int i = 0; i < SPINS; ++i) {
+        if (slot.state.load(std::memory_order_acquire) == expected) return true;
+        std::this_thread::yield();
+    }
+    while (true) {
+        slot.waiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seen = slot.state.load(std::memory_order_seq_cst);
+        if (seen != expected) {
+            futex_wait(slot.state, seen, SLEEP_NS);
+        }
+        slot.waiters.fetch_sub(1, std::memory_order_relaxed);
+        if (slot.state.load(std::memory_order_acquire) == expected) return true;
+        if (give_up()) return false;
+    }
+}
+
+// Serves a shared-memory ring with a pool of threads until SIGINT or SIGTERM. Each thread encodes into its own
+// scratch and writes the ids back over the request text in the same slot.
+class ShmTokenizerServer {
+public:
+    ShmTokenizerServer(const FrozenTokenizer& tokenizer, const ShmOptions& opts)
+        : tokenizer(tokenizer), opts(opts), policy(tokenizer.special_policy(opts.specials, opts.allowed_specials)),
+          segment(ShmSegment::create(opts.name, opts.num_slots, opts.slot_bytes)) {}
+
+    ~ShmTokenizerServer() {
+        stop();
+    }
+
+    ShmTokenizerServer(const ShmTokenizerServer&) = delete;
+    ShmTokenizerServer& operator=(const ShmTokenizerServer&) = delete;
+
+    void run() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        start();
+        int signal;
+        sigwait(&signals, &signal);
+        stop();
+    }
+
+    // Starts the worker threads without waiting for a signal; `stop` ends them.
+    void start() {
+        for (int i = 0; i < std::max(1, opts.num_threads); ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    void stop() {
+        segment.header().stopping.store(1);
+        for (uint32_t i = 0; i < opts.num_slots; ++i) {
+            futex_wake_all(segment.slot(i)->state);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+private:
+    void work() {
+        ShmHeader& header = segment.header();
+        EncodeScratch scratch;
+        std::vector<int> ids;
+        auto stopping = [&] { return header.stopping.load() != 0; };
+        while (!stopping()) {
+            uint64_t ticket = header.consumer_ticket.fetch_add(1);
+            ShmSlot& slot = *segment.slot(ticket);
+            bool abandoned = false;
+            bool ready = wait_for_slot(slot, slot_state(ticket, SLOT_REQUESTED), [&] {
+                abandoned = reclaim_unsent(slot, ticket);
+                return abandoned || stopping();
+            });
+            if (abandoned) continue;
+            if (!ready) return;
+            handle(slot, scratch, ids);
+            publish_slot(slot, slot_state(ticket, SLOT_DONE));
+        }
+    }
+
+    // Frees a slot whose producer died between claiming ticket t and sending the request. The owner is dead, so
+    // the state checked afterwards can no longer change under us.
+    bool reclaim_unsent(ShmSlot& slot, uint64_t ticket) const {
+        uint64_t owner = slot.owner.load();
+        uint32_t pid = static_cast<uint32_t>(owner);
+        if (owner != slot_owner(ticket, pid) || !process_gone(pid)) {
+            return false;
+        }
+        uint32_t state = slot.state.load();
+        uint64_t next = ticket + segment.header().num_slots;
+        if (state == slot_state(ticket, SLOT_REQUESTED) ||
+            !slot.owner.compare_exchange_strong(owner, slot_owner(next, 0))) {
+            return false;
+        }
+        advance_slot(slot, state, slot_state(next, SLOT_FREE));
+        return true;
+    }
+
+    void handle(ShmSlot& slot, EncodeScratch& scratch, std::vector<int>& ids) const {
+        char* data = ShmSegment::slot_data(&slot);
+        try {
+            if (slot.length > opts.slot_bytes) {
+                throw std::invalid_argument("request length exceeds the slot size");
+            }
+            if (slot.op == OP_ENCODE || slot.op == OP_COUNT) {
+                ids.clear();
+                tokenizer.encode(std::string_view(data, slot.length), ids, scratch, policy);
+                if (slot.op == OP_COUNT) {
+                    put_u32(data, static_cast<uint32_t>(ids.size()));
+                    slot.length = sizeof(uint32_t);
+                } else {
+                    if (ids.size() * sizeof(uint32_t) > opts.slot_bytes) {
+                        throw std::length_error(std::to_string(ids.size()) + " ids do not fit the slot");
+                    }
+                    for (size_t i = 0; i < ids.size(); ++i) {
+                        put_u32(data + i * sizeof(uint32_t), static_cast<uint32_t>(ids[i]));
+                    }
+                    slot.length = static_cast<uint32_t>(ids.size() * sizeof(uint32_t));
+                }
+            } else if (slot.op == OP_DECODE) {
+                if (slot.length % sizeof(uint32_t) != 0) {
+                    throw std::invalid_argument("decode payload is not a whole number of uint32 ids");
+                }
+                ids.resize(slot.length / sizeof(uint32_t));
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    ids[i] = static_cast<int>(get_u32(data + i * sizeof(uint32_t)));
+                }
+                std::string text = tokenizer.decode(ids);
+                if (text.size() > opts.slot_bytes) {
+                    throw std::length_error("decoded text does not fit the slot");
+                }
+                std::memcpy(data, text.data(), text.size());
+                slot.length = static_cast<uint32_t>(text.size());
+            } else {
+                throw std::invalid_argument("unknown op " + std::to_string(slot.op));
+            }
+            slot.status = STATUS_OK;
+        } catch (const std::exception& e) {
+            size_t size = std::min<size_t>(std::strlen(e.what()), opts.slot_bytes);
+            std::memcpy(data, e.what(), size);
+            slot.length = static_cast<uint32_t>(size);
+            slot.status = STATUS_ERROR;
+        }
+    }
+
+    const FrozenTokenizer& tokenizer;
+    ShmOptions opts;
+    SpecialPolicy policy;
+    ShmSegment segment;
+    std::vector<std::thread> workers;
+};
+
+// Producer side. `submit` copies a request into the next slot and returns its ticket; `wait` blocks for that
+// ticket's result. Up to num_slots requests may be outstanding per client, which lets a data loader keep the
+// server busy without threads of its own. `claim`, `payload_data` and `send` are `submit` in three steps, for callers
+// that write the request into the slot themselves. Producers that submit while holding unanswered tickets must
+// together stay within num_slots outstanding, or each can end up waiting for a slot another one holds. Not
+// thread-safe; use one client per producer thread.
+class ShmTokenizerClient {
+public:
+    explicit ShmTokenizerClient(const std::string& name) : segment(ShmSegment::attach(name)) {}
+
+    uint32_t max_payload() const {
+        return segment.header().slot_bytes;
+    }
+
+    uint64_t submit(uint8_t op, std::string_view payload) {
+        check_length(payload.size());
+        uint64_t ticket = claim();
+        std::memcpy(payload_data(ticket), payload.data(), payload.size());
+        send(ticket, op, payload.size());
+        return ticket;
+    }
+
+    // Takes the next free slot. Waiting for it frees the slot if its previous producer died without taking its
+    // result.
+    uint64_t claim() {
+        ShmHeader& header = segment.header();
+        if (outstanding == header.num_slots) {
+            throw std::runtime_error("Too many outstanding shared-memory requests");
+        }
+        uint32_t pid = static_cast<uint32_t>(::getpid());
+        while (true) {
+            uint64_t ticket = header.producer_ticket.load();
+            ShmSlot& slot = *segment.slot(ticket);
+            uint64_t owner = slot.owner.load();
+            if (owner == slot_owner(ticket, 0) && slot.owner.compare_exchange_strong(owner, slot_owner(ticket, pid))) {
+                header.producer_ticket.compare_exchange_strong(ticket, ticket + 1);
+                // The releaser may not have published free yet; doing it here makes its late publish a no-op.
+                publish_slot(slot, slot_state(ticket, SLOT_FREE));
+                outstanding++;
+                return ticket;
+            }
+            uint64_t previous = ticket - header.num_slots;
+            if (owner != slot_owner(previous, static_cast<uint32_t>(owner))) {
+                // Ticket t is taken: its producer has not moved the counter on yet, or the server skipped it.
+                header.producer_ticket.compare_exchange_strong(ticket, ticket + 1);
+                continue;
+            }
+            wait_or_throw(slot, slot_state(ticket, SLOT_FREE), [&] {
+                return header.producer_ticket.load() != ticket || slot.owner.load() != owner ||
+                       reclaim_done(slot, ticket, owner);
+            });
+        }
+    }
+
+    char* payload_data(uint64_t ticket) const {
+        return ShmSegment::slot_data(segment.slot(ticket));
+    }
+
+    void send(uint64_t ticket, uint8_t op, size_t length) {
+        check_length(length);
+        ShmSlot& slot = *segment.slot(ticket);
+        slot.op = op;
+        slot.length = static_cast<uint32_t>(length);
+        publish_slot(slot, slot_state(ticket, SLOT_REQUESTED));
+    }
+
+    // Returns the status. `read(status, result)` sees the result in place, before the slot is freed.
+    template <class Read>
+    uint8_t wait(uint64_t ticket, Read read) {
+        ShmSlot& slot = *segment.slot(ticket);
+        wait_or_throw(slot, slot_state(ticket, SLOT_DONE));
+        uint8_t status = static_cast<uint8_t>(slot.status);
+        read(status, std::string_view(ShmSegment::slot_data(&slot), slot.length));
+        uint64_t next = ticket + segment.header().num_slots;
+        slot.owner.store(slot_owner(next, 0));
+        advance_slot(slot, slot_state(ticket, SLOT_DONE), slot_state(next, SLOT_FREE));
+        outstanding--;
+        return status;
+    }
+
+    uint8_t call(uint8_t op, std::string_view payload, std::string& response) {
+        return wait(submit(op, payload), [&](uint8_t, std::string_view result) { response.assign(result); });
+    }
+
+    void encode(std::string_view text, std::vector<int>& out) {
+        std::string error;
+        wait(submit(OP_ENCODE, text), [&](uint8_t status, std::string_view result) {
+            if (status != STATUS_OK) {
+                error.assign(result);
+                return;
+            }
+            size_t offset = out.size();
+            out.resize(offset + result.size() / sizeof(uint32_t));
+            for (size_t i = offset; i < out.size(); ++i) {
+                out[i] = static_cast<int>(get_u32(result.data() + (i - offset) * sizeof(uint32_t)));
+            }
+        });
+        if (!error.empty()) {
+            throw std::runtime_error("Encode failed: " + error);
+        }
+    }
+
+private:
+    void check_length(size_t length) const {
+        if (length > max_payload()) {
+            throw std::length_error("Request of " + std::to_string(length) + " bytes exceeds the " +
+                                    std::to_string(max_payload()) + "-byte slot");
+        }
+    }
+
+    // Frees slot t % num_slots for ticket t if ticket t - num_slots is done but its producer died before taking
+    // the result.
+    bool reclaim_done(ShmSlot& slot, uint64_t ticket, uint64_t owner) {
+        uint64_t previous = ticket - segment.header().num_slots;
+        uint32_t done = slot_state(previous, SLOT_DONE);
+        if (!process_gone(static_cast<uint32_t>(owner)) || slot.state.load() != done ||
+            !slot.owner.compare_exchange_strong(owner, slot_owner(ticket, 0))) {
+            return false;
+        }
+        advance_slot(slot, done, slot_state(ticket, SLOT_FREE));
+        return true;
+    }
+
+    // Waits for `expected`, returning early once `moved` holds; throws if the server goes away.
+    template <class Moved>
+    void wait_or_throw(ShmSlot& slot, uint32_t expected, Moved moved) {
+        const ShmHeader& header = segment.header();
+        bool stopped = false;
+        wait_for_slot(slot, expected, [&] {
+            stopped = header.stopping.load() != 0 || process_gone(static_cast<uint32_t>(header.server_pid));
+            return stopped || moved();
+        });
+        if (stopped) {
+            throw std::runtime_error("Tokenizer server stopped");
+        }
+    }
+
+    void wait_or_throw(ShmSlot& slot, uint32_t expected) {
+        wait_or_throw(slot, expected, [] { return false; });
+    }
+
+    ShmSegment segment;
+    uint32_t outstanding = 0;
+};
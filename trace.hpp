@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Optional span recorder that writes Chrome trace-event JSON (chrome://tracing, Perfetto). Spans are timed with
+// CLOCK_MONOTONIC, the clock `perf record -k CLOCK_MONOTONIC` uses, and each thread appends to its own ring, so the
+// record path takes no locks; when a ring is full the oldest spans are overwritten. With perf markers on, span
+// boundaries are also written to the ftrace trace_marker file, which `perf record -e ftrace:print` picks up next to
+// the samples. Rings are read when the trace is written, after the traced work has finished.
+const size_t TRACE_RING_CAPACITY = 1 << 16;
+const int TRACE_MAX_ARGS = 4;
+const int TRACE_MERGE_BATCH = 256;
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    const char* arg_names[TRACE_MAX_ARGS];
+    int64_t arg_values[TRACE_MAX_ARGS];
+};
+
+inline uint64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class TraceRecorder {
+public:
+    static TraceRecorder& instance() {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    ~TraceRecorder() {
+        if (marker_fd >= 0) ::close(marker_fd);
+    }
+
+    // Returns false if perf markers were requested but no trace_marker file could be opened.
+    bool start(bool perf_markers) {
+        bool ok = true;
+        if (perf_markers && marker_fd < 0) {
+            for (const char* path : {"/sys/kernel/tracing/trace_marker", "/sys/kernel/debug/tracing/trace_marker"}) {
+                marker_fd = ::open(path, O_WRONLY | O_CLOEXEC);
+                if (marker_fd >= 0) break;
+            }
+            ok = marker_fd >= 0;
+        }
+        active.store(true, std::memory_order_relaxed);
+        return ok;
+    }
+
+    void stop() {
+        active.store(false, std::memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    void record(const TraceEvent& event) {
+        Ring& ring = thread_ring();
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        if (ring.events.size() < TRACE_RING_CAPACITY) {
+            ring.events.push_back(event);
+        } else {
+            ring.events[head % TRACE_RING_CAPACITY] = event;
+        }
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    void marker(const char* phase, const char* name, int64_t value) {
+        if (marker_fd < 0) return;
+        char line[128];
+        int n = std::snprintf(line, sizeof(line), "bpe %s %s %lld\n", phase, name, static_cast<long long>(value));
+        if (n > 0 && ::write(marker_fd, line, std::min<size_t>(n, sizeof(line) - 1)) < 0) {
+            // A failed marker only loses the annotation.
+        }
+    }
+
+    void write_json(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        char buffer[64];
+        for (size_t tid = 0; tid < rings.size(); ++tid) {
+            const Ring& ring = *rings[tid];
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            size_t count = std::min<uint64_t>(head, ring.events.size());
+            out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << ::getpid()
+                << ", \"tid\": " << tid << ", \"args\": {\"name\": \"thread " << tid << "\"}}";
+            first = false;
+            for (uint64_t i = head - count; i < head; ++i) {
+                const TraceEvent& event = ring.events[i % TRACE_RING_CAPACITY];
+                out << ",\n{\"name\": \"" << event.name << "\", \"cat\": \"" << event.category
+                    << "\", \"ph\": \"X\", \"pid\": " << ::getpid() << ", \"tid\": " << tid;
+                std::snprintf(buffer, sizeof(buffer), "%.3f", event.start_ns / 1e3);
+                out << ", \"ts\": " << buffer;
+                std::snprintf(buffer, sizeof(buffer), "%.3f", event.duration_ns / 1e3);
+                out << ", \"dur\": " << buffer << ", \"args\": {";
+                for (int a = 0; a < TRACE_MAX_ARGS && event.arg_names[a]; ++a) {
+                    out << (a > 0 ? ", " : "") << "\"" << event.arg_names[a] << "\": " << event.arg_values[a];
+                }
+                out << "}}";
+            }
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    struct Ring {
+        std::vector<TraceEvent> events;
+        std::atomic<uint64_t> head{0};
+    };
+
+    // Rings stay owned by the recorder after their thread exits.
+    Ring& thread_ring() {
+        thread_local Ring* ring = nullptr;
+        if (!ring) {
+            std::lock_guard<std::mutex> lock(mutex);
+            rings.push_back(std::make_unique<Ring>());
+            ring = rings.back().get();
+            ring->events.reserve(256);
+        }
+        return *ring;
+    }
+
+    std::atomic<bool> active{false};
+    int marker_fd = -1;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+inline bool tracing() {
+    return TraceRecorder::instance().enabled();
+}
+
+// Records a complete ("X") event from construction to destruction if tracing was on when it started, with a perf
+// marker at each end. Names must be string literals.
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const char* category) : on(tracing()) {
+        if (!on) return;
+        event = TraceEvent{name, category, trace_now_ns(), 0, {}, {}};
+        TraceRecorder::instance().marker("begin", name, 0);
+    }
+
+    ~TraceSpan() {
+        if (!on) return;
+        event.duration_ns = trace_now_ns() - event.start_ns;
+        TraceRecorder::instance().record(event);
+        TraceRecorder::instance().marker("end", event.name, 0);
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void arg(const char* name, int64_t value) {
+        if (!on) return;
+        for (int a = 0; a < TRACE_MAX_ARGS; ++a) {
+            if (event.arg_names[a] == nullptr) {
+                event.arg_names[a] = name;
+                event.arg_values[a] = value;
+                return;
+            }
+        }
+    }
+
+private:
+    bool on;
+    TraceEvent event;
+};
+
+// Groups training merges into "merge_batch" spans of TRACE_MERGE_BATCH merges, splitting each batch's time between
+// picking pairs off the heap and applying them. The perf markers carry the first merge id of the batch.
+class MergeBatchTrace {
+public:
+    MergeBatchTrace() : on(tracing()) {}
+
+    ~MergeBatchTrace() {
+        flush();
+    }
+
+    MergeBatchTrace(const MergeBatchTrace&) = delete;
+    MergeBatchTrace& operator=(const MergeBatchTrace&) = delete;
+
+    void begin(int id) {
+        if (!on) return;
+        last = trace_now_ns();
+        if (merges == 0) {
+            start = last;
+            first_id = id;
+            TraceRecorder::instance().marker("begin", "merge_batch", id);
+        }
+    }
+
+    void picked() {
+        if (!on) return;
+        uint64_t now = trace_now_ns();
+        pick_ns += now - last;
+        last = now;
+    }
+
+    void applied(int count = 1) {
+        if (!on) return;
+        apply_ns += trace_now_ns() - last;
+        merges += count;
+        if (merges >= TRACE_MERGE_BATCH) flush();
+    }
+
+private:
+    void flush() {
+        if (!on || merges == 0) return;
+        TraceEvent event{"merge_batch", "train", start, trace_now_ns() - start,
+                         {"first_merge", "merges", "pick_us", "apply_us"},
+                         {first_id, merges, static_cast<int64_t>(pick_ns / 1000),
+                          static_cast<int64_t>(apply_ns / 1000)}};
+        TraceRecorder::instance().record(event);
+        TraceRecorder::instance().marker("end", "merge_batch", first_id + merges - 1);
+        merges = 0;
+        pick_ns = apply_ns = 0;
+    }
+
+    bool on;
+    uint64_t start = 0;
+    uint64_t last = 0;
+    uint64_t pick_ns = 0;
+    uint64_t apply_ns = 0;
+    int64_t first_id = 0;
+    int64_t merges = 0;
+};